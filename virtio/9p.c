@@ -26,6 +26,8 @@ enum {
 	NOTAG = 0,
 	ONLYTAG = 1,
 	STRMAX = 127, // not including the null
+	PIPEDEPTH = 4, // Treads or Twrites in flight at once
+	PIPEMIN = 16*1024, // smaller chunks are not worth splitting
 };
 
 #define READ16LE(S) ((255 & ((char *)S)[1]) << 8 | (255 & ((char *)S)[0]))
@@ -56,10 +58,12 @@ enum {
    ((char *)P)[7] = (0xFF00000000000000 & (V)) >> 070, ((char *)P) + 8)
 
 uint32_t Max9;
+uint32_t Roundtrips9;
 
 static uint32_t openfids;
 
 static volatile bool flag;
+static volatile bool pipedone[PIPEDEPTH]; // the tag of each pipeline request points here
 
 static void **physicals; // newptr allocated block
 
@@ -70,6 +74,9 @@ int bufcnt;
 #define READQID(ptr) (struct Qid9){*(char *)(ptr), READ32LE((char *)(ptr)+1), READ64LE((char *)(ptr)+5)}
 
 static int transact(uint8_t cmd, const char *tfmt, const char *rfmt, ...);
+static int pipeline(uint8_t cmd, uint32_t fid, char *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
+static void lockRanges(const struct MemoryBlock *ranges, int n, int ntx, PhysicalAddress *pa, uint32_t *sz, long max, long *txn, long *rxn);
+static void unlockRanges(const struct MemoryBlock *ranges, int n);
 
 int Init9(int bufs) {
 	enum {Tversion = 100}; // size[4] Tversion tag[2] msize[4] version[s]
@@ -284,6 +291,22 @@ int Readdir9(void *buf, struct Qid9 *retqid, char *rettype, char retname[512]) {
 	return 0;
 }
 
+// Offset to pass to SeekReaddir9 to resume after the last entry returned
+uint64_t TellReaddir9(void *buf) {
+	struct rdbuf *rdbuf = RDBUFALIGN(buf);
+
+	return rdbuf->nextRequest;
+}
+
+// Discard anything buffered and continue the listing from an offset
+void SeekReaddir9(void *buf, uint64_t offset) {
+	struct rdbuf *rdbuf = RDBUFALIGN(buf);
+
+	rdbuf->nextRequest = offset;
+	rdbuf->recvd = 0;
+	rdbuf->used = 0;
+}
+
 int Getattr9(uint32_t fid, uint64_t request_mask, struct Stat9 *ret) {
 	enum {Tgetattr = 24}; // size[4] Tgetattr tag[2] fid[4] request_mask[8]
 	enum {Rgetattr = 25}; // size[4] Rgetattr tag[2] valid[8] qid[13]
@@ -293,7 +316,7 @@ int Getattr9(uint32_t fid, uint64_t request_mask, struct Stat9 *ret) {
 	                      // ctime_sec[8] ctime_nsec[8] btime_sec[8]
 	                      // btime_nsec[8] gen[8] data_version[8]
 
-	transact(Tgetattr, "dq", "qQdddqqqqqqqqqqqqqqq",
+	return transact(Tgetattr, "dq", "qQdddqqqqqqqqqqqqqqq",
 		fid, request_mask,
 
 		// very many return fields
@@ -311,12 +334,51 @@ int Setattr9(uint32_t fid, uint32_t request_mask, struct Stat9 to) {
                           // atime_sec[8] atime_nsec[8] mtime_sec[8] mtime_nsec[8]
 	enum {Rsetattr = 27}; // size[4] Rsetattr tag[2]
 
-	transact(Tsetattr, "dddddqqqqq", "",
+	return transact(Tsetattr, "dddddqqqqq", "",
 		fid, request_mask,
 		to.mode, to.uid, to.gid, to.size,
 		to.atime_sec, to.atime_nsec, to.mtime_sec, to.mtime_nsec);
 }
 
+int Statfs9(uint32_t fid, struct Statfs9 *ret) {
+	enum {Tstatfs = 8}; // size[4] Tstatfs tag[2] fid[4]
+	enum {Rstatfs = 9}; // size[4] Rstatfs tag[2] type[4] bsize[4]
+	                    // blocks[8] bfree[8] bavail[8]
+	                    // files[8] ffree[8] fsid[8] namelen[4]
+
+	return transact(Tstatfs, "d", "ddqqqqqqd",
+		fid,
+		&ret->type, &ret->bsize,
+		&ret->blocks, &ret->bfree, &ret->bavail,
+		&ret->files, &ret->ffree, &ret->fsid, &ret->namelen);
+}
+
+// Read the attribute through newfid with Read9, then clunk newfid
+int Xattrwalk9(uint32_t fid, uint32_t newfid, const char *name, uint64_t *retsize) {
+	enum {Txattrwalk = 30}; // size[4] Txattrwalk tag[2] fid[4] newfid[4] name[s]
+	enum {Rxattrwalk = 31}; // size[4] Rxattrwalk tag[2] size[8]
+
+	if (newfid < 32 && fid != newfid && (openfids & (1<<newfid))) Clunk9(newfid);
+
+	int err = transact(Txattrwalk, "dds", "q",
+		fid, newfid, name,
+		retsize);
+	if (err) return err;
+
+	if (newfid < 32) openfids |= 1<<newfid;
+	return 0;
+}
+
+// Turns fid into an attribute to Write9 exactly size bytes to, set on Clunk9
+// flags: 0 = create or replace, 1 = XATTR_CREATE, 2 = XATTR_REPLACE
+int Xattrcreate9(uint32_t fid, const char *name, uint64_t size, uint32_t flags) {
+	enum {Txattrcreate = 32}; // size[4] Txattrcreate tag[2] fid[4] name[s] attr_size[8] flags[4]
+	enum {Rxattrcreate = 33}; // size[4] Rxattrcreate tag[2]
+
+	return transact(Txattrcreate, "dsqd", "",
+		fid, name, size, flags);
+}
+
 int Clunk9(uint32_t fid) {
 	enum {Tclunk = 120}; // size[4] Tclunk tag[2] fid[4]
 	enum {Rclunk = 121}; // size[4] Rclunk tag[2]
@@ -355,8 +417,174 @@ int Write9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *a
 		actual_count);
 }
 
-void QueueNotified9(void) {
-	flag = true;
+// Like Read9 and Write9, but keep several requests in flight, so that the host
+// can be reading or writing one chunk while we take delivery of another.
+// Still returns only when all are done: the File Manager completes the call
+// (ioResult and ioCompletion) as soon as an external filesystem returns.
+int ReadMany9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
+	enum {Tread = 116};
+	return pipeline(Tread, fid, buf, offset, count, actual_count);
+}
+
+int WriteMany9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
+	enum {Twrite = 118};
+	return pipeline(Twrite, fid, buf, offset, count, actual_count);
+}
+
+void QueueNotified9(void *tag) {
+	if (tag) {
+		*(volatile bool *)tag = true;
+	} else {
+		flag = true;
+	}
+}
+
+// Responses are taken in order, so the count is always of contiguous bytes,
+// and nothing is sent after a short read or write (EOF or disk full).
+// But writes already in flight past a short one may still land, and grow the
+// file: the caller knows how long it should be, so it must cut it back.
+static int pipeline(uint8_t cmd, uint32_t fid, char *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
+	enum {Twrite = 118};
+	enum {HDR = 23}; // size[4] Tread/Twrite tag[2] fid[4] offset[8] count[4]
+	enum {RHDR = 11}; // size[4] Rread/Rwrite/Rlerror tag[2] count/ecode[4]
+
+	bool iswrite = (cmd == Twrite);
+
+	// Each request gets an equal share of the descriptors: the headers can
+	// straddle a page boundary, and so can each end of the chunk
+	long budget = bufcnt / PIPEDEPTH;
+	uint32_t chunk = 4096 * (budget - 5);
+	if (chunk > Max9 - HDR) chunk = (Max9 - HDR) & ~4095;
+
+	uint32_t even = ((count + PIPEDEPTH - 1) / PIPEDEPTH + 4095) & ~4095;
+	if (even < PIPEMIN) even = PIPEMIN;
+	if (chunk > even) chunk = even;
+
+	// Nothing to be gained (or a tiny virtqueue), so one request at a time
+	if (count <= chunk || budget < 8) {
+		uint32_t done = 0;
+		int err = 0;
+		while (done < count) {
+			uint32_t want = count - done, got = 0;
+			if (want > Max9 - HDR) want = Max9 - HDR;
+			if (iswrite) {
+				err = Write9(fid, buf + done, offset + done, want, &got);
+			} else {
+				err = Read9(fid, buf + done, offset + done, want, &got);
+			}
+			done += got;
+			if (err || got < want) break;
+		}
+		if (actual_count) *actual_count = done;
+		return err;
+	}
+
+	struct {
+		char t[HDR], r[RHDR];
+		struct MemoryBlock ranges[3];
+	} slots[PIPEDEPTH];
+
+	uint32_t sent = 0, taken = 0; // requests
+	uint32_t sentbytes = 0, done = 0;
+	bool stop = false;
+	int err = 0;
+
+	while (taken < sent || (!stop && sentbytes < count)) {
+		// Keep the pipe full
+		while (!stop && sentbytes < count && sent - taken < PIPEDEPTH) {
+			int n = sent % PIPEDEPTH;
+			uint32_t want = count - sentbytes;
+			if (want > chunk) want = chunk;
+
+			char *t = slots[n].t;
+			WRITE32LE(t, HDR + (iswrite ? want : 0)); // size field
+			*(t+4) = cmd;
+			WRITE16LE(t+5, ONLYTAG + n); // transact() has tag zero
+			WRITE32LE(t+7, fid);
+			WRITE64LE(t+11, offset + sentbytes);
+			WRITE32LE(t+19, want);
+			slots[n].r[4] = 0;
+
+			// Data goes after the header in whichever direction
+			slots[n].ranges[0] = (struct MemoryBlock){.address=t, .count=HDR};
+			slots[n].ranges[iswrite ? 1 : 2] = (struct MemoryBlock){.address=buf+sentbytes, .count=want};
+			slots[n].ranges[iswrite ? 2 : 1] = (struct MemoryBlock){.address=slots[n].r, .count=RHDR};
+
+			long txn, rxn;
+			PhysicalAddress pa[budget];
+			uint32_t sz[budget];
+			lockRanges(slots[n].ranges, 3, iswrite ? 2 : 1, pa, sz, budget, &txn, &rxn);
+
+			Roundtrips9++;
+			pipedone[n] = false;
+			QSend(0, txn, rxn, (void *)pa, sz, (void *)&pipedone[n]);
+
+			sent++;
+			sentbytes += want;
+		}
+		QNotify(0);
+
+		// Wait for the oldest
+		int n = taken % PIPEDEPTH;
+		while (!pipedone[n]) QPoll(0); // spin -- unfortunate
+		unlockRanges(slots[n].ranges, 3);
+		taken++;
+
+		if (stop) continue; // in flight past a short transfer, ignore
+		char *r = slots[n].r;
+		uint32_t want = READ32LE(slots[n].t+19);
+
+		if (r[4] == 7 /*Rlerror*/) {
+			err = READ32LE(r+7);
+			stop = true;
+		} else {
+			uint32_t got = READ32LE(r+7);
+			if (got > want) got = want;
+			done += got;
+			if (got < want) stop = true;
+		}
+	}
+
+	if (actual_count) *actual_count = done;
+	return err;
+}
+
+// Lock logical ranges and turn them into virtqueue buffers (tx ranges first)
+static void lockRanges(const struct MemoryBlock *ranges, int n, int ntx, PhysicalAddress *pa, uint32_t *sz, long max, long *txn, long *rxn) {
+	*txn = *rxn = 0;
+
+	for (int i=0; i<n; i++) {
+		if (ranges[i].count == 0) continue;
+
+		if (LockMemory(ranges[i].address, ranges[i].count)) {
+			panic("cannot lock memory");
+		}
+
+		MemoryBlock mbs[256] = {ranges[i]};
+		long extents = 255;
+
+		if (GetPhysical((void *)mbs, &extents) || extents >= 255) {
+			panic("cannot get physical memory");
+		}
+
+		for (int j=0; j<extents; j++) {
+			if (*txn+*rxn == max) panic("too discontiguous");
+
+			pa[*txn+*rxn] = mbs[j+1].address;
+			sz[*txn+*rxn] = mbs[j+1].count;
+			if (i < ntx) {
+				(*txn)++;
+			} else {
+				(*rxn)++;
+			}
+		}
+	}
+}
+
+static void unlockRanges(const struct MemoryBlock *ranges, int n) {
+	for (int i=0; i<n; i++) {
+		if (ranges[i].count) UnlockMemory(ranges[i].address, ranges[i].count);
+	}
 }
 
 /*
@@ -409,6 +637,8 @@ static int transact(uint8_t cmd, const char *tfmt, const char *rfmt, ...) {
 		}
 	}
 
+	Roundtrips9++;
+
 	WRITE32LE(t, ts + tbigsize); // size field
 	*(t+4) = cmd; // T-command number
 	WRITE16LE(t+5, 0); // zero is our only tag number (for now...)
@@ -457,7 +687,7 @@ static int transact(uint8_t cmd, const char *tfmt, const char *rfmt, ...) {
 	// (Assume that if a "B" trailer is supplied, it is large enough)
 	if (rs < 11 && rbigsize == 0) rs = 11;
 
-	long txn = 0, rxn = 0;
+	long txn, rxn;
 	PhysicalAddress pa[bufcnt];
 	uint32_t sz[bufcnt];
 
@@ -468,47 +698,14 @@ static int transact(uint8_t cmd, const char *tfmt, const char *rfmt, ...) {
 		{.address=rbig, .count=rbigsize},
 	};
 
-#define CLEANUP() {for (int i=0; i<4; i++) {if (beenlocked & (1<<i)) {UnlockMemory(logiranges[i].address, logiranges[i].count);}}}
-
-	int beenlocked = 0; // a bitmask for when we clean up
-
-	for (int i=0; i<4; i++) {
-		if (logiranges[i].count == 0) continue;
-
-		if (LockMemory(logiranges[i].address, logiranges[i].count)) {
-			CLEANUP();
-			panic("cannot lock memory");
-		}
-
-		beenlocked |= (1<<i);
-
-		MemoryBlock mbs[256] = {logiranges[i]};
-		long extents = 255;
-
-		if (GetPhysical((void *)mbs, &extents) || extents >= 255) {
-			CLEANUP();
-			panic("cannot get physical memory");
-		}
-
-		for (int j=0; j<extents; j++) {
-			if (txn+rxn == bufcnt) panic("too discontiguous");
-
-			pa[txn+rxn] = mbs[j+1].address;
-			sz[txn+rxn] = mbs[j+1].count;
-			if (i < 2) {
-				txn++;
-			} else {
-				rxn++;
-			}
-		}
-	}
+	lockRanges(logiranges, 4, 2, pa, sz, bufcnt, &txn, &rxn);
 
 	flag = false;
 	QSend(0, txn, rxn, (void *)pa, sz, NULL);
 	QNotify(0);
 	while (!flag) QPoll(0); // spin -- unfortunate
 
-	CLEANUP();
+	unlockRanges(logiranges, 4);
 
 // 	printf("< ");
 // 	for (int i=0; i<rs; i++) {
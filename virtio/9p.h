@@ -181,6 +181,7 @@ enum {
 };
 
 extern uint32_t Max9;
+extern uint32_t Roundtrips9; // incremented by every request, for profiling
 
 struct Qid9 {
 	uint8_t type;
@@ -207,6 +208,18 @@ struct Stat9 {
 	uint64_t ctime_nsec;
 };
 
+struct Statfs9 {
+	uint32_t type;
+	uint32_t bsize;
+	uint64_t blocks;
+	uint64_t bfree;
+	uint64_t bavail;
+	uint64_t files;
+	uint64_t ffree;
+	uint64_t fsid;
+	uint32_t namelen;
+};
+
 int Init9(int bufs);
 int Attach9(uint32_t fid, uint32_t afid, const char *uname, const char *aname, uint32_t n_uname, struct Qid9 *retqid);
 int Walk9(uint32_t fid, uint32_t newfid, uint16_t nwname, const char *const *name, uint16_t *retnwqid, struct Qid9 *retqid);
@@ -218,9 +231,16 @@ int Renameat9(uint32_t olddirfid, const char *oldname, uint32_t newdirfid, const
 int Mkdir9(uint32_t dfid, uint32_t mode, uint32_t gid, const char *name, struct Qid9 *retqid);
 void InitReaddir9(uint32_t fid, void *buf, size_t bufsize);
 int Readdir9(void *buf, struct Qid9 *retqid, char *rettype, char retname[512]);
+uint64_t TellReaddir9(void *buf);
+void SeekReaddir9(void *buf, uint64_t offset);
 int Getattr9(uint32_t fid, uint64_t request_mask, struct Stat9 *ret);
 int Setattr9(uint32_t fid, uint32_t request_mask, struct Stat9 to);
+int Statfs9(uint32_t fid, struct Statfs9 *ret);
+int Xattrwalk9(uint32_t fid, uint32_t newfid, const char *name, uint64_t *retsize);
+int Xattrcreate9(uint32_t fid, const char *name, uint64_t size, uint32_t flags);
 int Clunk9(uint32_t fid);
 int Read9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
 int Write9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
-void QueueNotified9(void);
+int ReadMany9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
+int WriteMany9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
+void QueueNotified9(void *tag);
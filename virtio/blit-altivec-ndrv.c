@@ -0,0 +1,189 @@
+// AltiVec blitters for the direct-color depths (built with -maltivec)
+// Blit only calls these when Gestalt has reported vector instructions
+
+#include <altivec.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blit.h"
+
+typedef vector unsigned char vu8;
+typedef vector unsigned short vu16;
+typedef vector bool char vb8;
+
+static void row16(const uint16_t *src, uint8_t *dst, long n, const vu8 tab[6], const uint8_t *bytes);
+static void row32(const uint8_t *src, uint8_t *dst, long n, const vu8 *tab, const uint8_t *bytes);
+static vu8 load(const void *p);
+static vu8 lookup(vu8 v, const vu8 *tab);
+
+// Returns zero if the scalar blitter should do the job instead
+int BlitAltivec(int bppshift,
+	short t, short l, short b, short r, const void *src, void *dest, long rowbytes,
+	uint8_t red[256], uint8_t grn[256], uint8_t blu[256]) {
+
+	long rowbytes_dest = rowbytes << (5 - bppshift);
+
+	if (bppshift == 4) {
+		// Only 32 possible values per channel, so each is a single vperm:
+		// blue, green and red, in two vectors each
+		// (static because the Mac OS stack is not 16-byte aligned, and lvx
+		// would quietly round the address down)
+		static vu8 tab[6] __attribute__((aligned(16)));
+		uint8_t *bytes = (uint8_t *)tab;
+		for (int c=0; c<32; c++) {
+			int expanded = (c << 3) | (c >> 2);
+			bytes[c] = blu[expanded];
+			bytes[32+c] = grn[expanded];
+			bytes[64+c] = red[expanded];
+		}
+
+		for (short y=t; y<b; y++) {
+			row16((const uint16_t *)((const char *)src + y * rowbytes) + l,
+				(uint8_t *)dest + y * rowbytes_dest + l * 4,
+				r - l, tab, bytes);
+		}
+		return 1;
+	} else if (bppshift == 5) {
+		// A 256-entry lookup is eight vperms, so it had better be only one
+		// table (or none, which is the usual case)
+		if (memcmp(red, grn, 256) || memcmp(red, blu, 256)) return 0;
+
+		static vu8 tab[16] __attribute__((aligned(16)));
+		memcpy(tab, red, 256);
+
+		int identity = 1;
+		for (int i=0; i<256; i++) {
+			if (red[i] != i) {
+				identity = 0;
+				break;
+			}
+		}
+
+		for (short y=t; y<b; y++) {
+			row32((const uint8_t *)src + y * rowbytes + l * 4,
+				(uint8_t *)dest + y * rowbytes_dest + l * 4,
+				r - l, identity ? NULL : tab, red);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+// 0RRRRRGGGGGBBBBB to BGRX, sixteen pixels per iteration
+static void row16(const uint16_t *src, uint8_t *dst, long n, const vu8 tab[6], const uint8_t *bytes) {
+	const vu16 mask = vec_splat_u16(31), five = vec_splat_u16(5), ten = vec_splat_u16(10);
+	const vu8 zero = vec_splat_u8(0);
+
+	// Scalar until the destination is aligned, and again for the last few
+	while (n > 0 && ((uintptr_t)dst & 15)) {
+		uint16_t s = *src++;
+		dst[0] = bytes[s & 31];
+		dst[1] = bytes[32 + ((s >> 5) & 31)];
+		dst[2] = bytes[64 + ((s >> 10) & 31)];
+		dst[3] = 0;
+		dst += 4;
+		n--;
+	}
+
+	for (; n >= 16; n -= 16) {
+		vu16 a = (vu16)load(src), b = (vu16)load(src + 8);
+
+		vu8 bi = vec_pack(vec_and(a, mask), vec_and(b, mask));
+		vu8 gi = vec_pack(vec_and(vec_sr(a, five), mask), vec_and(vec_sr(b, five), mask));
+		vu8 ri = vec_pack(vec_and(vec_sr(a, ten), mask), vec_and(vec_sr(b, ten), mask));
+
+		vu8 bv = vec_perm(tab[0], tab[1], bi);
+		vu8 gv = vec_perm(tab[2], tab[3], gi);
+		vu8 rv = vec_perm(tab[4], tab[5], ri);
+
+		// B G pairs and R 0 pairs, then interleave the pairs
+		vu16 bg = (vu16)vec_mergeh(bv, gv), r0 = (vu16)vec_mergeh(rv, zero);
+		vec_st((vu8)vec_mergeh(bg, r0), 0, dst);
+		vec_st((vu8)vec_mergel(bg, r0), 16, dst);
+		bg = (vu16)vec_mergel(bv, gv);
+		r0 = (vu16)vec_mergel(rv, zero);
+		vec_st((vu8)vec_mergeh(bg, r0), 32, dst);
+		vec_st((vu8)vec_mergel(bg, r0), 48, dst);
+
+		src += 16;
+		dst += 64;
+	}
+
+	while (n > 0) {
+		uint16_t s = *src++;
+		dst[0] = bytes[s & 31];
+		dst[1] = bytes[32 + ((s >> 5) & 31)];
+		dst[2] = bytes[64 + ((s >> 10) & 31)];
+		dst[3] = 0;
+		dst += 4;
+		n--;
+	}
+}
+
+// xRGB to BGRX through one gamma table (or none if tab is NULL), four pixels per vector
+static void row32(const uint8_t *src, uint8_t *dst, long n, const vu8 *tab, const uint8_t *bytes) {
+	const vu8 swizzle = {3, 2, 1, 16, 7, 6, 5, 16, 11, 10, 9, 16, 15, 14, 13, 16};
+	const vu8 zero = vec_splat_u8(0);
+
+	while (n > 0 && ((uintptr_t)dst & 15)) {
+		dst[0] = bytes[src[3]];
+		dst[1] = bytes[src[2]];
+		dst[2] = bytes[src[1]];
+		dst[3] = 0;
+		src += 4;
+		dst += 4;
+		n--;
+	}
+
+	if (tab) {
+		for (; n >= 4; n -= 4) {
+			vec_st(vec_perm(lookup(load(src), tab), zero, swizzle), 0, dst);
+			src += 16;
+			dst += 16;
+		}
+	} else {
+		for (; n >= 4; n -= 4) {
+			vec_st(vec_perm(load(src), zero, swizzle), 0, dst);
+			src += 16;
+			dst += 16;
+		}
+	}
+
+	while (n > 0) {
+		dst[0] = bytes[src[3]];
+		dst[1] = bytes[src[2]];
+		dst[2] = bytes[src[1]];
+		dst[3] = 0;
+		src += 4;
+		dst += 4;
+		n--;
+	}
+}
+
+// Unaligned load that only touches the 16-byte blocks holding the data,
+// so never strays past the end of the buffer
+static vu8 load(const void *p) {
+	const uint8_t *bp = p;
+	return vec_perm(vec_ld(0, bp), vec_ld(15, bp), vec_lvsl(0, bp));
+}
+
+// Each vperm looks up 32 entries by the low five bits of the index,
+// then the high three bits choose between the results
+static vu8 lookup(vu8 v, const vu8 *tab) {
+	const vu8 one = vec_splat_u8(1);
+	const vu8 bit5 = vec_sl(one, vec_splat_u8(5));
+	const vu8 bit6 = vec_sl(one, vec_splat_u8(6));
+	const vu8 bit7 = vec_sl(one, vec_splat_u8(7));
+
+	vb8 m5 = vec_cmpeq(vec_and(v, bit5), bit5);
+	vb8 m6 = vec_cmpeq(vec_and(v, bit6), bit6);
+	vb8 m7 = vec_cmpeq(vec_and(v, bit7), bit7);
+
+	vu8 q0 = vec_sel(vec_perm(tab[0], tab[1], v), vec_perm(tab[2], tab[3], v), m5);
+	vu8 q1 = vec_sel(vec_perm(tab[4], tab[5], v), vec_perm(tab[6], tab[7], v), m5);
+	vu8 q2 = vec_sel(vec_perm(tab[8], tab[9], v), vec_perm(tab[10], tab[11], v), m5);
+	vu8 q3 = vec_sel(vec_perm(tab[12], tab[13], v), vec_perm(tab[14], tab[15], v), m5);
+
+	return vec_sel(vec_sel(q0, q1, m6), vec_sel(q2, q3, m6), m7);
+}
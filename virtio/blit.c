@@ -7,13 +7,28 @@ const char BlitterAlign[6] = {
 	4, // 2-bit
 	4, // 4-bit
 	1, // 8-bit
-	2, // 16-bit
+	4, // 16-bit (two pixels per word)
 	4, // 32-bit
 };
 
+int BlitterAltivec;
+
+// 0RRRRRGGGGGBBBBB to BGRX, with the 5-bit channels stretched to 8 bits
+void BlitTable15(uint32_t table[32768], uint8_t red[256], uint8_t grn[256], uint8_t blu[256]) {
+	for (int r=0; r<32; r++) {
+		uint32_t rpart = (uint32_t)red[(r << 3) | (r >> 2)] << 8;
+		for (int g=0; g<32; g++) {
+			uint32_t rgpart = rpart | ((uint32_t)grn[(g << 3) | (g >> 2)] << 16);
+			for (int b=0; b<32; b++) {
+				*table++ = rgpart | ((uint32_t)blu[(b << 3) | (b >> 2)] << 24);
+			}
+		}
+	}
+}
+
 void Blit(int bppshift,
 	short t, short *l, short b, short *r, const void *src, void *dest, long rowbytes,
-	uint32_t clut[256], uint8_t red[256], uint8_t grn[256], uint8_t blu[256]) {
+	uint32_t *clut, uint8_t red[256], uint8_t grn[256], uint8_t blu[256]) {
 
 	long bytealign = BlitterAlign[bppshift];
 	long pixalign = bytealign << 3 >> bppshift;
@@ -22,6 +37,11 @@ void Blit(int bppshift,
 	*l &= -pixalign;
 	*r = (*r + pixalign - 1) & -pixalign;
 
+#if defined(__powerpc__)
+	if (BlitterAltivec && bppshift >= 4 &&
+		BlitAltivec(bppshift, t, *l, b, *r, src, dest, rowbytes, red, grn, blu)) return;
+#endif
+
 	if (bppshift == 0) {
 		int leftBytes = *l / 8;
 		int rightBytes = *r / 8;
@@ -90,15 +110,24 @@ void Blit(int bppshift,
 			}
 		}
 	} else if (bppshift == 4) {
+		// clut is the 32768-entry table from BlitTable15
 		for (short y=t; y<b; y++) {
-			uint16_t *srcctr = (void *)((char *)src + y * rowbytes + *l * 2);
+			uint32_t *srcctr = (void *)((char *)src + y * rowbytes + *l * 2);
 			uint32_t *destctr = (void *)((char *)dest + y * rowbytes_dest + *l * 4);
-			for (short x=*l; x<*r; x++) {
-				uint16_t s = *srcctr++;
-				*destctr++ =
-					((uint32_t)blu[((s & 0x1f) << 3) | ((s & 0x1f) << 3 >> 5)] << 24) |
-					((uint32_t)grn[((s & 0x3e0) >> 5 << 3) | ((s & 0x3e0) >> 5 << 3 >> 5)] << 16) |
-					((uint32_t)red[((s & 0x7c00) >> 10 << 3) | ((s & 0x7c00) >> 10 << 3 >> 5)] << 8);
+			short x = *l;
+			for (; x+4<=*r; x+=4) {
+				uint32_t s0 = srcctr[0], s1 = srcctr[1];
+				destctr[0] = clut[(s0 >> 16) & 0x7fff];
+				destctr[1] = clut[s0 & 0x7fff];
+				destctr[2] = clut[(s1 >> 16) & 0x7fff];
+				destctr[3] = clut[s1 & 0x7fff];
+				srcctr += 2;
+				destctr += 4;
+			}
+			if (x < *r) {
+				uint32_t s = *srcctr;
+				destctr[0] = clut[(s >> 16) & 0x7fff];
+				destctr[1] = clut[s & 0x7fff];
 			}
 		}
 	} else if (bppshift == 5) {
@@ -8,9 +8,21 @@ extern const char BlitterAlign[6];
 
 // The pointers to l and r return the actual width copied after alignment,
 // which is useful for knowing if the cursor needs redrawing.
+// clut has 256 entries for the indexed depths, or is the BlitTable15
+// table at 16 bits. red/grn/blu are only used at 32 bits (and by AltiVec).
 void Blit(int bppshift,
 	short t, short *l, short b, short *r, const void *src, void *dest, long rowbytes,
-	uint32_t clut[256], uint8_t red[256], uint8_t grn[256], uint8_t blu[256]);
+	uint32_t *clut, uint8_t red[256], uint8_t grn[256], uint8_t blu[256]);
+
+// Rebuild the 16-bit lookup table after the gamma changes (128 KB, so not often)
+void BlitTable15(uint32_t table[32768], uint8_t red[256], uint8_t grn[256], uint8_t blu[256]);
+
+// Set by the caller if Gestalt reports AltiVec, to use blit-altivec-ndrv.c
+// for the 16 and 32-bit depths (PowerPC only, otherwise ignored)
+extern int BlitterAltivec;
+int BlitAltivec(int bppshift,
+	short t, short l, short b, short r, const void *src, void *dest, long rowbytes,
+	uint8_t red[256], uint8_t grn[256], uint8_t blu[256]);
 
 // Work in 32-bit longs
 void blit1asm(const void *srcpix, long srcrowskip, void *dstpix, long dstrowskip, long w, long h, uint32_t color0, uint32_t colorXOR);
@@ -0,0 +1,254 @@
+/*
+The CNID database, kept in the hash table
+
+'$' cnid -> struct rec, the parent's CNID and the name with its length, or
+    with POOLED set in the parent, the nameid of a shared name instead
+'I' nameid -> struct name, a name shared by several CNIDs
+'N' hash of name -> nameid (on a collision the newer name is just not shared)
+
+Most names are unique, so a name lives in its '$' record until a second CNID
+turns up with the same one, and only then moves to the pool. A small table of
+recently stored names (outside the hash table) spots the second sighting, so a
+unique name costs one entry, as it did before there was a pool. Repeats far
+apart can be missed, which only costs memory.
+
+The length is kept next to the name, so building a path is one lookup per
+component (two for a shared name) and no strlen.
+
+Also builds on the host, for the benchmark in hashtab.c.
+*/
+
+#include <string.h>
+
+#include "hashtab.h"
+
+#include "cniddb.h"
+
+enum {
+	SEEN = 512, // recently stored names, 2 KB
+};
+
+#define POOLED 0x80000000 // never set in a CNID (see qid2cnid)
+
+struct rec {
+	uint32_t parent;
+	union {
+		uint32_t nameid; // POOLED
+		struct {
+			uint16_t len;
+			char str[512];
+		} own;
+	};
+};
+
+struct name {
+	uint32_t refs;
+	uint16_t len;
+	char str[512];
+};
+
+bool dbDirty;
+
+static uint32_t nextNameID = 1; // zero means none
+static int32_t seen[SEEN]; // by name hash, a CNID whose '$' record holds the name
+
+static void putRec(int32_t cnid, int32_t pcnid, const char *name, int len, uint32_t nameid);
+static uint32_t findName(const char *name, int len, uint32_t hash);
+static uint32_t poolName(const char *name, int len, uint32_t hash, uint32_t refs);
+static void releaseName(uint32_t nameid);
+static uint32_t nameHash(const char *name, int len);
+
+void setDB(int32_t cnid, int32_t pcnid, const char *name) {
+	int len = strlen(name);
+
+	// Most calls are from browse() repeating what we know already
+	int32_t oldparent;
+	int oldlen;
+	const char *oldname = getDBEntry(cnid, &oldparent, &oldlen);
+	if (oldname && oldparent == pcnid && oldlen == len && !memcmp(oldname, name, len)) return;
+
+	dbDirty = true;
+
+	struct rec *old = HTlookup('$', &cnid, sizeof cnid);
+	uint32_t oldid = old && (old->parent & POOLED) ? old->nameid : 0;
+
+	uint32_t hash = nameHash(name, len);
+	uint32_t nameid = findName(name, len, hash);
+
+	if (!nameid) {
+		// The second CNID with this name, so both share it from now on
+		int32_t first = seen[hash % SEEN];
+		struct rec *f = first != cnid ? HTlookup('$', &first, sizeof first) : NULL;
+		if (f && !(f->parent & POOLED) && f->own.len == len && !memcmp(f->own.str, name, len)) {
+			int32_t fparent = f->parent; // f moves when the table changes
+			nameid = poolName(name, len, hash, 2);
+			putRec(first, fparent, name, len, nameid);
+			seen[hash % SEEN] = 0;
+		}
+	}
+
+	putRec(cnid, pcnid, name, len, nameid);
+	if (!nameid) seen[hash % SEEN] = cnid;
+
+	// Only now, so that renaming to the same name doesn't drop it from the pool
+	if (oldid) releaseName(oldid);
+}
+
+void forgetDB(int32_t cnid) {
+	struct rec *rec = HTlookup('$', &cnid, sizeof cnid);
+	if (!rec) return;
+	uint32_t nameid = rec->parent & POOLED ? rec->nameid : 0;
+	HTdelete('$', &cnid, sizeof cnid);
+	if (nameid) releaseName(nameid);
+	dbDirty = true;
+}
+
+// NULL on failure (bad CNID)
+const char *getDBName(int32_t cnid) {
+	return getDBEntry(cnid, NULL, NULL);
+}
+
+// Same as strlen(getDBName(cnid)) but cheaper, zero on failure
+int getDBNameLen(int32_t cnid) {
+	int len = 0;
+	getDBEntry(cnid, NULL, &len);
+	return len;
+}
+
+// Zero on failure (bad CNID)
+int32_t getDBParent(int32_t cnid) {
+	struct rec *rec = HTlookup('$', &cnid, sizeof cnid);
+	if (!rec) return 0;
+	return rec->parent & ~POOLED;
+}
+
+// The name, and optionally the parent and name length, in one go
+// NULL on failure (bad CNID)
+const char *getDBEntry(int32_t cnid, int32_t *parent, int *len) {
+	struct rec *rec = HTlookup('$', &cnid, sizeof cnid);
+	if (!rec) return NULL;
+	if (parent) *parent = rec->parent & ~POOLED;
+	if (!(rec->parent & POOLED)) {
+		if (len) *len = rec->own.len;
+		return rec->own.str;
+	}
+
+	struct name *n = HTlookup('I', &rec->nameid, sizeof rec->nameid);
+	if (!n) return NULL;
+	if (len) *len = n->len;
+	return n->str;
+}
+
+// Is the CNID connected to the root by the database?
+bool connectedDB(int32_t cnid) {
+	for (int depth=0; depth<100; depth++) {
+		if (cnid == 2) return true;
+		cnid = getDBParent(cnid);
+		if (cnid == 0) return false;
+	}
+	return false; // probably a cycle
+}
+
+// Walk every CNID in no particular order, starting with *cursor = 0
+bool nextDB(size_t *cursor, int32_t *cnid) {
+	const void *key;
+	if (!HTiterate('$', cursor, &key, NULL, NULL)) return false;
+	memcpy(cnid, key, sizeof *cnid);
+	return true;
+}
+
+// Can a CNID with a name this long be added without the table wanting to grow?
+bool roomDB(int len) {
+	return HTroom(sizeof (int32_t), offsetof(struct rec, own.str) + len + 1) &&
+		HTroom(sizeof (uint32_t), offsetof(struct name, str) + len + 1);
+}
+
+// Fill blob with the names from the root down to a CNID, each null-terminated,
+// and comps and cnids with each component's name and CNID
+// *blobsize is the room in blob on entry and the bytes used on return
+// Returns the number of components, or -1 for a bad CNID or too long a path
+int pathDB(int32_t cnid, char *blob, int *blobsize, char **comps, int32_t *cnids, int maxcomps) {
+	int nbytes = *blobsize, n = maxcomps;
+
+	// One walk up to the root, filling from the end
+	while (cnid != 2) {
+		int32_t parent;
+		int len;
+		const char *name = getDBEntry(cnid, &parent, &len);
+		if (!name || n == 0 || nbytes < len + 1) return -1;
+		n--;
+		nbytes -= len + 1;
+		comps[n] = memcpy(blob + nbytes, name, len + 1);
+		cnids[n] = cnid;
+		cnid = parent;
+	}
+
+	// Then slide everything down to the start
+	int count = maxcomps - n;
+	memmove(blob, blob + nbytes, *blobsize - nbytes);
+	for (int i=0; i<count; i++) {
+		comps[i] = comps[n + i] - nbytes;
+		cnids[i] = cnids[n + i];
+	}
+	*blobsize -= nbytes;
+	return count;
+}
+
+// The name goes in the record, unless it is in the pool (nameid nonzero)
+static void putRec(int32_t cnid, int32_t pcnid, const char *name, int len, uint32_t nameid) {
+	struct rec rec = {.parent = pcnid};
+	int size;
+
+	if (nameid) {
+		rec.parent |= POOLED;
+		rec.nameid = nameid;
+		size = offsetof(struct rec, nameid) + sizeof nameid;
+	} else {
+		rec.own.len = len;
+		memcpy(rec.own.str, name, len + 1);
+		size = offsetof(struct rec, own.str) + len + 1;
+	}
+
+	HTinstall('$', &cnid, sizeof cnid, &rec, size);
+}
+
+// Take another reference to a name already in the pool, zero if it isn't
+static uint32_t findName(const char *name, int len, uint32_t hash) {
+	uint32_t *shared = HTlookup('N', &hash, sizeof hash);
+	if (!shared) return 0;
+
+	uint32_t nameid = *shared;
+	struct name *n = HTlookup('I', &nameid, sizeof nameid);
+	if (!n || n->len != len || memcmp(n->str, name, len)) return 0;
+	n->refs++;
+	return nameid;
+}
+
+// Add a name to the pool with this many references
+static uint32_t poolName(const char *name, int len, uint32_t hash, uint32_t refs) {
+	uint32_t nameid = nextNameID++;
+	struct name n = {.refs = refs, .len = len};
+	memcpy(n.str, name, len + 1);
+	HTinstall('I', &nameid, sizeof nameid, &n, offsetof(struct name, str) + len + 1);
+	if (!HTlookup('N', &hash, sizeof hash)) HTinstall('N', &hash, sizeof hash, &nameid, sizeof nameid);
+	return nameid;
+}
+
+static void releaseName(uint32_t nameid) {
+	struct name *n = HTlookup('I', &nameid, sizeof nameid);
+	if (!n || --n->refs) return;
+
+	uint32_t hash = nameHash(n->str, n->len);
+	uint32_t *shared = HTlookup('N', &hash, sizeof hash);
+	if (shared && *shared == nameid) HTdelete('N', &hash, sizeof hash);
+	HTdelete('I', &nameid, sizeof nameid);
+}
+
+// FNV-1a
+static uint32_t nameHash(const char *name, int len) {
+	uint32_t hash = 2166136261;
+	for (int i=0; i<len; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619;
+	}
+	return hash;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The CNID database: (CNID) -> (parent's CNID, name), kept in the hash table
+// Names are UTF-8, null-terminated, and only valid until the next change
+
+extern bool dbDirty; // changed since the last snapshot
+
+void setDB(int32_t cnid, int32_t pcnid, const char *name);
+void forgetDB(int32_t cnid);
+const char *getDBName(int32_t cnid);
+int getDBNameLen(int32_t cnid);
+int32_t getDBParent(int32_t cnid);
+const char *getDBEntry(int32_t cnid, int32_t *parent, int *len);
+bool connectedDB(int32_t cnid);
+bool nextDB(size_t *cursor, int32_t *cnid);
+bool roomDB(int len);
+int pathDB(int32_t cnid, char *blob, int *blobsize, char **comps, int32_t *cnids, int maxcomps);
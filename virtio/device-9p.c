@@ -24,6 +24,7 @@ not used because it is unavailable at the start of the boot process.
 #include <Traps.h>
 
 #include "callupp.h"
+#include "cniddb.h"
 #include "device.h"
 #include "hashtab.h"
 #include "printf.h"
@@ -46,6 +47,16 @@ not used because it is unavailable at the start of the boot process.
 #define p2cstr(c, p) {uint8_t l=p[0]; memcpy(c, p+1, l); c[l]=0;}
 #define pstrcpy(d, s) memcpy(d, s, 1+(unsigned char)s[0])
 
+// Snapshot of the CNID database at the root of the share (hidden by visName)
+#define DBNAME ".cnid-db"
+#define DBTEMP ".cnid-db-new"
+
+// Extended attribute of the data fork holding a struct meta
+#define METAXATTR "user.mac9p.meta"
+
+// Binary fsCall trace, appended to on request (decode with fstrace.py)
+#define TRACENAME ".fstrace"
+
 #define unaligned32(ptr) (((uint32_t)*(uint16_t *)(ptr) << 16) | *((uint16_t *)(ptr) + 1))
 
 // rename some FCB fields for our own use
@@ -57,6 +68,7 @@ enum {
 	// so if the dispatch mechanism changes, this constant must change:
 	FSID = ('9'<<8) | 'p',
 	ROOTFID = 2,
+	DBFID = 13, // the CNID database snapshot, while loading or saving
 	WDLO = -32767,
 	WDHI = -4096,
 	STACKSIZE = 64 * 1024, // large stack bc memory is so hard to allocate
@@ -71,6 +83,61 @@ struct longdqe {
 	void *dispatcher;
 };
 
+// Snapshot file: this header, then "count" packed records of
+// cnid[4] parent[4] namelen[2] name[namelen] (not null-terminated)
+struct dbHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t rootpath; // qid of the share root: if it changes, discard everything
+	uint32_t count;
+} __attribute__((packed));
+
+// Finder info and resource fork length of a file, in one place. The Finder
+// info is an extended attribute, or else the .idump sidecar file. The length
+// is never stored, because the .rsrc sidecar's own length is always right.
+struct meta {
+	struct FInfo finfo;
+	struct FXInfo fxinfo;
+	uint32_t rsrclen;
+} __attribute__((packed));
+#define METASIZE offsetof(struct meta, rsrclen) // the attribute's part
+
+enum {
+	DBMAGIC = 'CNDB',
+	DBVERSION = 1,
+};
+
+// One fsCall in the trace ring, big-endian like everything else here
+// Refnum calls (Read, SetEOF etc) fill count/actual/position, the rest
+// fill dirID with the ioDirID field before and after the call
+struct traceRec {
+	uint16_t selector; // & 0xf0ff, as in PBPrint
+	int16_t result;
+	uint32_t start; // us
+	uint32_t duration; // us
+	int32_t dirID;
+	int32_t outDirID;
+	uint32_t count;
+	uint32_t actual;
+	uint32_t position;
+	uint16_t roundtrips;
+	int16_t vRefNum;
+	int16_t refNum;
+	unsigned char name[26]; // Pascal, truncated
+} __attribute__((packed));
+
+enum {
+	TRACERECS = 1024, // 64K ring
+	TRACEOFF = 0, TRACEON = 1, TRACELOG = 2, TRACEFILE = 3, // DriverConfigure 'trce' arguments
+};
+
+// One open FCB of each fork of a file (zero if none): the rest can be found
+// on its fcb9Link ring. Kept in the hash table under tag 'F', keyed by CNID.
+struct forks {
+	short data;
+	short rsrc;
+};
+
 struct bootBlock {
 	uint16_t magic;
 	uint32_t entryBRA;
@@ -105,7 +172,16 @@ static void ensureFutureMount(void);
 static void lateBootHook(void);
 static OSErr boot(void);
 static void setDirPBInfo(struct DirInfo *pb, int32_t cnid, uint32_t fid);
-static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, uint32_t fid);
+static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, uint32_t fid, struct Qid9 qid);
+static int getattrCached(uint32_t fid, struct Qid9 qid, struct Stat9 *ret);
+static void forgetAttr(int32_t cnid);
+static void volBlocks(bool hfs, uint32_t *blksize, uint16_t *total, uint16_t *free);
+static void getMeta(uint32_t fid, int32_t cnid, struct meta *meta);
+static void setMeta(uint32_t fid, int32_t cnid, const struct meta *meta);
+static bool setXattrMeta(uint32_t fid, const struct meta *meta);
+static bool catMatch(struct CSParam *pb, int32_t cnid, int32_t parent, const char *name, uint32_t dirfid);
+static bool catMatchName(const unsigned char *name, const unsigned char *want, bool partial);
+static bool catMaskEqual(const void *val, const void *want, const void *mask, size_t len);
 static int32_t browse(uint32_t fid, int32_t cnid, const unsigned char *paspath);
 static bool setPath(int32_t cnid);
 static bool appendRelativePath(const unsigned char *path);
@@ -122,9 +198,16 @@ static bool isAbs(const unsigned char *path);
 static void pathSplitRoot(const unsigned char *path, unsigned char *root, unsigned char *shorter);
 static void pathSplitLeaf(const unsigned char *path, unsigned char *dir, unsigned char *name);
 static bool visName(const char *name);
-static void setDB(int32_t cnid, int32_t pcnid, const char *name);
-static const char *getDBName(int32_t cnid);
-static int32_t getDBParent(int32_t cnid);
+static struct forks getOpenForks(int32_t cnid);
+static void setOpenForks(int32_t cnid, struct forks forks);
+static struct traceRec *traceStart(void *pb, unsigned short selector, uint32_t start);
+static void traceFinish(struct traceRec *rec, void *pb, OSErr result, uint32_t duration, uint32_t roundtrips);
+static bool isRefNumCall(unsigned short selector);
+static void traceFlush(bool toFile);
+static bool openDB(struct dbHeader *hdr);
+static void presizeDB(uint32_t snapshot);
+static void loadDB(const struct dbHeader *hdr);
+static void saveDB(void);
 static long fsCall(void *pb, long selector, void *stack);
 static OSErr fsDispatch(void *pb, unsigned short selector);
 static OSErr controlStatusCall(struct CntrlParam *pb);
@@ -150,7 +233,31 @@ static int pathCompCnt;
 static char pathBlob[512];
 static int pathBlobSize;
 
-static unsigned long hfsTimer, browseTimer, relistTimer;
+static struct profSlot profile[PROFSLOTS]; // of fsCall, by selector
+static struct traceRec *traceBuf; // NULL when not tracing
+static uint32_t traceCount; // ever recorded, so the next slot is traceCount % TRACERECS
+static bool dbReadOnly;
+static bool xattrMeta; // share supports extended attributes
+static bool xattrMigrate = true; // copy .idump Finder info into the xattr on read
+static struct Qid9 browseQid; // of the last successful browse()
+
+// Getattr9 results, keyed by qid.path, reused while the qid.version
+// (QEMU derives it from mtime and size) is unchanged and the entry is young
+// Set attrTTL to -1 to trust the cache forever: only if the guest has
+// exclusive use of the share, because then only our own writes invalidate it
+enum {ATTRCACHE = 16};
+static struct attrEntry {
+	unsigned long ticks;
+	struct Stat9 stat;
+} attrCache[ATTRCACHE];
+static int attrCacheNext;
+static long attrTTL = 60; // ticks
+static int32_t catGeneration; // changes with the catalog, so CatSearches must restart
+static struct Statfs9 statfsCache; // the Finder calls GetVolInfo constantly
+static unsigned long statfsTicks;
+static bool statfsAsked; // statfsTicks is meaningful
+static bool statfsValid; // the server answered, so statfsCache is meaningful
+static unsigned long dbSaveTicks;
 static short drvrRefNum;
 static struct Qid9 root;
 static struct bootBlock bootBlock = {
@@ -210,6 +317,7 @@ static struct GetVolParmsInfoBuffer vparms = {
 		| (1<<bNoBootBlks)
 		| (1<<bHasExtFSVol)
 		| (1<<bLocalWList)
+		| (1<<bHasCatSearch)
 		,
 	.vMServerAdr = 0, // might be used for uniqueness checking -- ?set uniq
 };
@@ -293,7 +401,7 @@ OSStatus DoDriverIO(AddressSpaceID spaceID, IOCommandID cmdID,
 }
 
 void DNotified(uint16_t q, size_t len, void *tag) {
-	QueueNotified9();
+	QueueNotified9(tag);
 }
 
 void DConfigChange(void) {
@@ -354,6 +462,13 @@ static OSStatus initialize(DriverInitInfo *info) {
 		return openErr;
 	}
 
+	// Keep Finder info in an xattr if the share supports them (ENODATA = yes)
+	uint64_t xsize;
+	int xerr = Xattrwalk9(ROOTFID, 20, METAXATTR, &xsize);
+	if (xerr == 0) Clunk9(20);
+	xattrMeta = (xerr == 0 || xerr == ENODATA);
+	printf("Finder info: %s\n", xattrMeta ? "xattr" : "sidecar files");
+
 	installDrive();
 
 	int32_t systemFolder = browse(3 /*fid*/, 2 /*cnid*/, "\pSystem Folder");
@@ -580,6 +695,14 @@ static OSErr fsMountVol(struct IOParam *pb) {
 	memcpy(name, VConfig + 2, nameLen);
 	mr27name(vcb.vcbVN, name); // and convert to short Mac Roman pascal string
 
+	// Warm start the CNID database, but only when allowed to move memory
+	if ((pb->ioTrap & 0x400) == 0) {
+		struct dbHeader hdr;
+		bool snapshot = openDB(&hdr);
+		presizeDB(snapshot ? hdr.count : 0);
+		if (snapshot) loadDB(&hdr);
+	}
+
 	setDB(2, 1, name);
 
 	vparms.vMLocalHand = NewHandleSysClear(2);
@@ -607,7 +730,6 @@ static OSErr fsMountVol(struct IOParam *pb) {
 	return noErr;
 }
 
-// TODO: fake used/free alloc blocks (there are limits depending on H bit)
 static OSErr fsGetVolInfo(struct HVolumeParam *pb) {
 	enum {MYFID = 9};
 
@@ -618,6 +740,19 @@ static OSErr fsGetVolInfo(struct HVolumeParam *pb) {
 		if (wdcb) cnid = wdcb->wdDirID;
 	}
 
+	// Apps that read the VCB directly get the conservative figures
+	uint32_t blksize;
+	uint16_t total, free;
+	volBlocks(false, &blksize, &total, &free);
+	vcb.vcbAlBlkSiz = vcb.vcbClpSiz = blksize;
+	vcb.vcbNmAlBlks = total;
+	vcb.vcbFreeBks = free;
+
+	volBlocks(pb->ioTrap & 0x200, &blksize, &total, &free);
+	pb->ioVAlBlkSiz = pb->ioVClpSiz = blksize;
+	pb->ioVNmAlBlks = total;
+	pb->ioVFrBlk = free;
+
 	// Count contained files
 	pb->ioVNmFls = 0;
 
@@ -638,6 +773,52 @@ static OSErr fsGetVolInfo(struct HVolumeParam *pb) {
 	return noErr;
 }
 
+// Real size and free space from Tstatfs, cached for a second
+// The counts are 16 bits, so the block size grows to fit. Without the H bit
+// (plain GetVolInfo) the totals are clamped to 2 GB, because older apps
+// multiply them out in a signed long.
+static void volBlocks(bool hfs, uint32_t *blksize, uint16_t *total, uint16_t *free) {
+	// A failure is remembered just as long, or every call would ask again
+	if (!statfsAsked || LMGetTicks() - statfsTicks >= 60) {
+		statfsValid = !Statfs9(ROOTFID, &statfsCache);
+		statfsTicks = LMGetTicks();
+		statfsAsked = true;
+	}
+
+	// Keep the old made-up numbers if the server won't say
+	uint64_t totalBytes = 0xf000 * 512ULL, freeBytes = 0xe000 * 512ULL;
+	if (statfsValid) {
+		totalBytes = statfsCache.blocks * statfsCache.bsize;
+		freeBytes = statfsCache.bavail * statfsCache.bsize;
+	}
+
+	if (!hfs) {
+		if (totalBytes > 0x7fffffff) totalBytes = 0x7fffffff;
+		if (freeBytes > 0x7fffffff) freeBytes = 0x7fffffff;
+	}
+	if (freeBytes > totalBytes) freeBytes = totalBytes;
+
+	uint32_t size = 512;
+	while (totalBytes / size > 0xffff && size < 0x40000000) size *= 2;
+
+	*blksize = size;
+	*total = totalBytes / size > 0xffff ? 0xffff : totalBytes / size;
+	*free = freeBytes / size > 0xffff ? 0xffff : freeBytes / size;
+}
+
+// FlushVol is called often, so save the CNID database at most once a minute
+static OSErr fsFlushVol(struct IOParam *pb) {
+	if (LMGetTicks() - dbSaveTicks >= 60*60) saveDB();
+	return noErr;
+}
+
+// Last chance to save the CNID database at shutdown
+// (but still let the File Manager refuse to unmount us)
+static OSErr fsUnmountVol(struct IOParam *pb) {
+	saveDB();
+	return extFSErr;
+}
+
 static OSErr fsGetVolParms(struct HIOParam *pb) {
 	short s = pb->ioReqCount;
 	if (s > 14) s = 14; // not the whole struct, just the v1 part
@@ -754,7 +935,7 @@ static OSErr fsGetFileInfo(struct HFileInfo *pb) {
 		if (!catalogCall) return fnfErr; // GetFileInfo predates directories
 		setDirPBInfo((void *)pb, cnid, MYFID);
 	} else {
-		setFilePBInfo((void *)pb, cnid, MYFID);
+		setFilePBInfo((void *)pb, cnid, MYFID, browseQid);
 	}
 
 	return noErr;
@@ -783,42 +964,18 @@ static void setDirPBInfo(struct DirInfo *pb, int32_t cnid, uint32_t fid) {
 	pb->ioDrParID = getDBParent(cnid);
 }
 
-static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, uint32_t fid) {
+static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, uint32_t fid, struct Qid9 qid) {
 	// Could use this for "permissions" info in the future
 	struct Stat9 stat = {};
-	Getattr9(fid, STAT_SIZE, &stat);
+	getattrCached(fid, qid, &stat);
 
-	// Resource fork info-getting, needs to be factored out
-	struct Stat9 rstat = {};
-	char rname[512];
-	strcpy(rname, getDBName(cnid));
-	strcat(rname, ".rsrc");
-	if (!Walk9(fid, 19, 2, (const char *[]){"..", rname}, NULL, NULL))
-		Getattr9(19, STAT_SIZE, &rstat);
-
-	// Finder info-getting, needs to be factored out
-	struct FInfo finfo = {};
-	char iname[512];
-	strcpy(iname, getDBName(cnid));
-	strcat(iname, ".idump");
-	if (!Walk9(fid, 19, 2, (const char *[]){"..", iname}, NULL, NULL))
-		if (!Lopen9(19, O_RDONLY, NULL, NULL))
-			Read9(19, &finfo, 0, 8, NULL);
+	struct meta meta;
+	getMeta(fid, cnid, &meta);
 
 	// Determine whether the file is open
-	bool openRF = false, openDF = false;
-	short openAs = 0, refnum = 0;
-	FCBRec *fcb = NULL;
-	while (UnivIndexFCB(&vcb, &refnum, &fcb) == noErr) {
-		if (fcb->fcbFlNm != cnid) continue;
-
-		openAs = refnum;
-		if (fcb->fcbFlags & fcbResourceMask) {
-			openRF = true;
-		} else {
-			openDF = true;
-		}
-	}
+	struct forks forks = getOpenForks(cnid);
+	bool openRF = forks.rsrc != 0, openDF = forks.data != 0;
+	short openAs = openDF ? forks.data : forks.rsrc;
 
 	// Clear shared "FileInfo" fields, from ioFlAttrib onward
 	memset((char *)pb + 30, 0, 80 - 30);
@@ -828,12 +985,12 @@ static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, uint32_t fid) {
 		(kioFlAttribResOpenMask * openRF) |
 		(kioFlAttribDataOpenMask * openDF) |
 		(kioFlAttribFileOpenMask * (openRF || openDF));
-	pb->ioFlFndrInfo = finfo;
+	pb->ioFlFndrInfo = meta.finfo;
 	if (pb->ioTrap & 0x200) pb->ioDirID = cnid; // peculiar field
 	pb->ioFlLgLen = stat.size;
 	pb->ioFlPyLen = (stat.size + 511) & -512;
-	pb->ioFlRLgLen = rstat.size;
-	pb->ioFlRPyLen = (rstat.size + 511) & -512;
+	pb->ioFlRLgLen = meta.rsrclen;
+	pb->ioFlRPyLen = (meta.rsrclen + 511) & -512;
 
 	if ((pb->ioTrap & 0xff) != 0x60) return;
 	// GetCatInfo only beyond this point
@@ -841,10 +998,79 @@ static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, uint32_t fid) {
 	// Clear only "CatInfo" fields, from ioFlBkDat onward
 	memset((char *)pb + 80, 0, 108 - 80);
 
+	pb->ioFlXFndrInfo = meta.fxinfo;
 	pb->ioFlParID = getDBParent(cnid);
 }
 
-// Set creator and type on files only
+// fid points to the data fork, and is not moved or opened
+static void getMeta(uint32_t fid, int32_t cnid, struct meta *meta) {
+	enum {XATTRFID = 20, SIDEFID = 19};
+
+	memset(meta, 0, sizeof *meta);
+
+	// The host can change the resource fork, so always ask its sidecar
+	char sname[512];
+	struct Stat9 rstat = {};
+	sprintf(sname, "%s.rsrc", getDBName(cnid));
+	if (!Walk9(fid, SIDEFID, 2, (const char *[]){"..", sname}, NULL, NULL)) {
+		Getattr9(SIDEFID, STAT_SIZE, &rstat);
+		Clunk9(SIDEFID);
+	}
+	meta->rsrclen = rstat.size;
+
+	// One attribute has all the Finder info
+	if (xattrMeta) {
+		uint64_t size;
+		uint32_t got = 0;
+		if (!Xattrwalk9(fid, XATTRFID, METAXATTR, &size)) {
+			if (size == METASIZE) Read9(XATTRFID, meta, 0, METASIZE, &got);
+			Clunk9(XATTRFID);
+		}
+		if (got == METASIZE) return;
+		memset(meta, 0, METASIZE);
+	}
+
+	// Otherwise fall back to the .idump sidecar
+	sprintf(sname, "%s.idump", getDBName(cnid));
+	if (!Walk9(fid, SIDEFID, 2, (const char *[]){"..", sname}, NULL, NULL)) {
+		bool found = !Lopen9(SIDEFID, O_RDONLY, NULL, NULL) &&
+			!Read9(SIDEFID, &meta->finfo, 0, 8, NULL); // type and creator only
+		Clunk9(SIDEFID);
+
+		// Move it to the attribute, so that the sidecar is only read once
+		// (unless the share refuses, e.g. because it is read-only)
+		if (found && xattrMeta && xattrMigrate) xattrMigrate = setXattrMeta(fid, meta);
+	}
+}
+
+// fid points to the data fork, and is not moved or opened
+static void setMeta(uint32_t fid, int32_t cnid, const struct meta *meta) {
+	enum {SIDEFID = 19};
+
+	if (xattrMeta && setXattrMeta(fid, meta)) return;
+
+	// The .idump sidecar only has room for type and creator
+	char iname[512];
+	sprintf(iname, "%s.idump", getDBName(cnid));
+	Walk9(fid, SIDEFID, 1, (const char *[]){".."}, NULL, NULL);
+	if (!Lcreate9(SIDEFID, O_WRONLY|O_TRUNC|O_CREAT, 0666, 0, iname, NULL, NULL)) {
+		Write9(SIDEFID, (void *)&meta->finfo, 0, 8, NULL); // don't care about actual count
+	}
+	Clunk9(SIDEFID);
+}
+
+// True if the attribute was written
+static bool setXattrMeta(uint32_t fid, const struct meta *meta) {
+	enum {XATTRFID = 20};
+
+	uint32_t got = 0;
+	Walk9(fid, XATTRFID, 0, NULL, NULL, NULL); // dupe shouldn't fail
+	if (!Xattrcreate9(XATTRFID, METAXATTR, METASIZE, 0))
+		Write9(XATTRFID, (void *)meta, 0, METASIZE, &got);
+	return !Clunk9(XATTRFID) && got == METASIZE; // set on clunk
+}
+
+// Set Finder info on files only (SetCatInfo also sets the extended part)
 // TODO set timestamps, the attributes byte (comes with AppleDouble etc)
 static OSErr fsSetFileInfo(struct HFileInfo *pb) {
 	enum {MYFID=3};
@@ -852,16 +1078,16 @@ static OSErr fsSetFileInfo(struct HFileInfo *pb) {
 	int32_t cnid = pbDirID(pb);
 	cnid = browse(MYFID, cnid, pb->ioNamePtr);
 	if (cnid < 0) return cnid;
+	if (isdir(cnid)) return noErr;
 
-	Walk9(MYFID, MYFID, 1, (const char *[]){".."}, NULL, NULL);
-
-	char iname[512];
-	sprintf(iname, "%s.idump", getDBName(cnid));
+	struct meta meta;
+	getMeta(MYFID, cnid, &meta);
+	meta.finfo = pb->ioFlFndrInfo;
+	if ((pb->ioTrap & 0xff) == 0x60) meta.fxinfo = pb->ioFlXFndrInfo;
+	setMeta(MYFID, cnid, &meta);
+	Clunk9(MYFID);
 
-	if (!Lcreate9(MYFID, O_WRONLY|O_TRUNC|O_CREAT, 0666, 0, iname, NULL, NULL)) {
-		Write9(MYFID, &pb->ioFlFndrInfo, 0, 8, NULL); // don't care about actual count
-		Clunk9(MYFID);
-	}
+	return noErr;
 }
 
 static OSErr fsSetVol(struct HFileParam *pb) {
@@ -971,7 +1197,12 @@ static OSErr fsOpen(struct HIOParam *pb) {
 	if (isdir(cnid)) return fnfErr;
 
 	struct Stat9 stat;
-	if (Getattr9(fid, 0, &stat)) return permErr;
+	if (getattrCached(fid, browseQid, &stat)) return permErr;
+
+	// Only the type is needed, for the FCB
+	struct meta meta;
+	getMeta(fid, cnid, &meta);
+	long type = meta.finfo.fdType ? meta.finfo.fdType : '????';
 
 	if (rfork) {
 		char rname[512];
@@ -1001,14 +1232,6 @@ static OSErr fsOpen(struct HIOParam *pb) {
 		}
 	}
 
-	long type = '????';
-	char iname[512];
-	strcpy(iname, getDBName(cnid));
-	strcat(iname, ".idump");
-	if (!Walk9(fid, 19, 2, (const char *[]){"..", iname}, NULL, NULL))
-		if (!Lopen9(19, O_RDONLY, NULL, NULL))
-			Read9(19, &type, 0, sizeof type, NULL);
-
 	*fcb = (struct FCBRec){
 		.fcbFlNm = cnid,
 		.fcbFlags =
@@ -1033,17 +1256,16 @@ static OSErr fsOpen(struct HIOParam *pb) {
 	mr31name(fcb->fcbCName, getDBName(cnid));
 
 	// Arrange FCBs of the same fork into a circular linked list
-	// Do a linear search for any other same-fork FCB
-	short fellowFile = 0;
+	// The open-forks table gives us any other same-fork FCB
+	struct forks forks = getOpenForks(cnid);
+	short *fellowFile = rfork ? &forks.rsrc : &forks.data;
 	FCBRec *fellowFCB;
-	while (UnivIndexFCB(&vcb, &fellowFile, &fellowFCB) == noErr) {
-		if (fellowFile == refn) continue; // can't be literally the same FCB
-		if (fellowFCB->fcbFlNm != fcb->fcbFlNm) continue; // must be same CNID
-		if ((fellowFCB->fcbFlags & fcbResourceMask) != (fcb->fcbFlags & fcbResourceMask)) continue; // must be same data/rsrc
-
+	if (*fellowFile && UnivResolveFCB(*fellowFile, &fellowFCB) == noErr) {
 		fcb->fcb9Link = fellowFCB->fcb9Link;
 		fellowFCB->fcb9Link = refn;
-		break;
+	} else {
+		*fellowFile = refn;
+		setOpenForks(cnid, forks);
 	}
 
 	pb->ioRefNum = refn;
@@ -1072,6 +1294,8 @@ static OSErr fsSetEOF(struct IOParam *pb) {
 
 	if (err) panic("seteof error");
 
+	if (!(fcb->fcbFlags & fcbResourceMask)) forgetAttr(fcb->fcbFlNm);
+
 	// Tell all the other FCBs about this new length
 	short fellowFile = pb->ioRefNum;
 	FCBRec *fellowFCB;
@@ -1106,6 +1330,14 @@ static OSErr fsClose(struct IOParam *pb) {
 		fellowFile = fellowFCB->fcb9Link;
 	}
 
+	// If the open-forks table points to this FCB, point it to another
+	struct forks forks = getOpenForks(fcb->fcbFlNm);
+	short *fork = (fcb->fcbFlags & fcbResourceMask) ? &forks.rsrc : &forks.data;
+	if (*fork == pb->ioRefNum) {
+		*fork = (fcb->fcb9Link == pb->ioRefNum) ? 0 : fcb->fcb9Link;
+		setOpenForks(fcb->fcbFlNm, forks);
+	}
+
 	Clunk9(fcb->fcb9FID);
 	fcb->fcbFlNm = 0;
 
@@ -1151,30 +1383,44 @@ static OSErr fsReadWrite(struct IOParam *pb) {
 		return posErr;
 	}
 
-	// Request the host
-	while (pb->ioActCount < pb->ioReqCount) {
-		uint32_t want = pb->ioReqCount - pb->ioActCount;
-		if (want > Max9) want = Max9;
-		if (usestackbuf && want > sizeof stackbuf) want = sizeof stackbuf;
-
+	// Request the host: several chunks at once if the buffer is DMA-able
+	if (!usestackbuf && pb->ioReqCount > 0) {
 		uint32_t got = 0;
 		int err;
 
 		if (iswrite) {
-			char *buf = pb->ioBuffer + pb->ioActCount;
-			if (usestackbuf) {
-				memcpy(stackbuf, buf, want);
-				buf = stackbuf;
-			}
+			err = WriteMany9(fcb->fcb9FID, pb->ioBuffer, fcb->fcbCrPs, pb->ioReqCount, &got);
 
-			err = Write9(fcb->fcb9FID, buf, fcb->fcbCrPs, want, &got);
-		} else {
-			char *buf = pb->ioBuffer + pb->ioActCount;
-			if (usestackbuf) {
-				buf = stackbuf; // discard: editing ROM is silently ignored
+			// Stopped short, but later chunks might have landed and grown the file
+			uint32_t end = fcb->fcbCrPs + pb->ioReqCount, keep = fcb->fcbCrPs + got;
+			if (got < pb->ioReqCount && end > fcb->fcbEOF) {
+				if (keep < fcb->fcbEOF) keep = fcb->fcbEOF;
+				Setattr9(fcb->fcb9FID, SET_SIZE, (struct Stat9){.size=keep});
 			}
+		} else {
+			err = ReadMany9(fcb->fcb9FID, pb->ioBuffer, fcb->fcbCrPs, pb->ioReqCount, &got);
+		}
+
+		pb->ioActCount = got;
+		fcb->fcbCrPs += got;
+		pb->ioPosOffset = fcb->fcbCrPs;
 
-			err = Read9(fcb->fcb9FID, buf, fcb->fcbCrPs, want, &got);
+		if (err) panic("io error... no idea what to do!");
+	}
+
+	while (usestackbuf && pb->ioActCount < pb->ioReqCount) {
+		uint32_t want = pb->ioReqCount - pb->ioActCount;
+		if (want > sizeof stackbuf) want = sizeof stackbuf;
+
+		uint32_t got = 0;
+		int err;
+
+		if (iswrite) {
+			memcpy(stackbuf, pb->ioBuffer + pb->ioActCount, want);
+			err = Write9(fcb->fcb9FID, stackbuf, fcb->fcbCrPs, want, &got);
+		} else {
+			// discard: editing ROM is silently ignored
+			err = Read9(fcb->fcb9FID, stackbuf, fcb->fcbCrPs, want, &got);
 		}
 
 		pb->ioActCount += got;
@@ -1186,6 +1432,9 @@ static OSErr fsReadWrite(struct IOParam *pb) {
 		if (got < want) break;
 	}
 
+	if (iswrite && pb->ioActCount && !(fcb->fcbFlags & fcbResourceMask))
+		forgetAttr(fcb->fcbFlNm);
+
 	// Is the fork (now) longer than we thought?
 	if (pb->ioPosOffset > fcb->fcbEOF) {
 		if (pb->ioActCount == 0) {
@@ -1262,6 +1511,7 @@ static OSErr fsCreate(struct HFileParam *pb) {
 		pb->ioDirID = cnid;
 	}
 
+	catGeneration++; // any CatSearch in progress is now stale
 	return noErr;
 }
 
@@ -1270,18 +1520,16 @@ static OSErr fsDelete(struct IOParam *pb) {
 	if (iserr(cnid)) return cnid;
 
 	// Do not allow removal of open files
-	short openFork = 0;
-	FCBRec *openFCB;
-	while (UnivIndexFCB(&vcb, &openFork, &openFCB) == noErr) {
-		if (openFCB->fcbFlNm == cnid) {
-			return fBsyErr;
-		}
-	}
+	struct forks forks = getOpenForks(cnid);
+	if (forks.data || forks.rsrc) return fBsyErr;
 
 	// This is hacky, needs to be replaced with systematic sidecar management
 	Walk9(10, 9, 1, (const char *[]){".."}, NULL, NULL);
 
 	if (Remove9(10)) return fBsyErr; // assume it was a full directory
+	catGeneration++;
+	forgetAttr(cnid);
+	forgetDB(cnid);
 
 	const char *sidecars[] = {"%s.rsrc", "%s.idump", "._%s"};
 	for (int i=0; i<sizeof sidecars/sizeof *sidecars; i++) {
@@ -1332,6 +1580,7 @@ static OSErr fsRename(struct IOParam *pb) {
 
 	// Commit to the rename, so correct the database
 	setDB(childCNID, parentCNID, newNameU);
+	catGeneration++;
 
 	// Then rename the sidecar files, not checking for errors
 	const char *sidecars[] = {"%s.rsrc", "%s.idump", "._%s"};
@@ -1399,9 +1648,274 @@ static OSErr fsCloseWD(struct WDParam *pb) {
 	return noErr;
 }
 
-static int32_t browse(uint32_t fid, int32_t cnid, const unsigned char *paspath) {
-	TIMEFUNC(browseTimer);
+// Breadth-first crawl of the whole share, resumable between calls.
+// Each search has a slot in catSearches, and its queue of directories still
+// to list lives in the hash table (tag 'Q', key = slot<<28 | queue index,
+// value = CNID). ioCatPosition.initialize is the search's ID, and priv[]
+// holds a struct catPosition. Several searches can be in progress at once,
+// and a new one takes the least recently used slot, so only the oldest
+// resumable search is lost. A catalog change stops them all.
+// Readdir9 returns the name, qid and type of each entry: enough to match on
+// name, directory-ness and parent without another round trip per entry.
+struct catPosition {
+	uint32_t head; // index into queue
+	uint64_t offset; // Readdir9 offset within that directory
+} __attribute__((packed));
+
+enum {CATSEARCHES = 4};
+static struct catSearch {
+	int32_t id; // zero if the slot is free
+	int32_t generation; // catGeneration when the search began
+	uint32_t tail; // queue index of the next directory found
+	uint32_t used; // catUses at the last call, to find the least recent
+} catSearches[CATSEARCHES];
+static int32_t catNextID;
+static uint32_t catUses;
+
+static uint32_t catKey(struct catSearch *search, uint32_t index) {
+	return ((uint32_t)(search - catSearches) << 28) | index;
+}
+
+// Free a slot and whatever is left of its queue
+static void catForget(struct catSearch *search, uint32_t head) {
+	for (uint32_t i=head; i<search->tail; i++) HTdelete('Q', &(uint32_t){catKey(search, i)}, 4);
+	search->id = 0;
+}
+
+static OSErr fsCatSearch(struct CSParam *pb) {
+	enum {DIRFID = 14, LISTFID = 15};
+
+	unsigned long start = LMGetTicks(), limit = 0;
+	if (pb->ioSearchTime > 0) { // milliseconds
+		limit = (pb->ioSearchTime * 60 + 999) / 1000;
+	} else if (pb->ioSearchTime < 0) { // microseconds
+		limit = (-pb->ioSearchTime / 1000 * 60 + 999) / 1000;
+	}
+
+	pb->ioActMatchCount = 0;
+	if (pb->ioReqMatchCount <= 0) return paramErr;
+
+	struct catPosition pos;
+	struct catSearch *search = NULL;
+	if (pb->ioCatPosition.initialize == 0) {
+		// New search, in a free slot or else the least recently used one
+		search = &catSearches[0];
+		for (int i=0; i<CATSEARCHES; i++) {
+			if (catSearches[i].id == 0) {
+				search = &catSearches[i];
+				break;
+			}
+			if (catSearches[i].used < search->used) search = &catSearches[i];
+		}
+		if (search->id) catForget(search, 0); // its owner gets catChangedErr
+
+		// Its queue contains only the root
+		if (++catNextID <= 0) catNextID = 1;
+		search->id = catNextID;
+		search->generation = catGeneration;
+		int32_t rootcnid = 2;
+		HTinstall('Q', &(uint32_t){catKey(search, 0)}, 4, &rootcnid, 4);
+		search->tail = 1;
+		pos = (struct catPosition){0, 0};
+	} else {
+		for (int i=0; i<CATSEARCHES; i++) {
+			if (catSearches[i].id == pb->ioCatPosition.initialize) search = &catSearches[i];
+		}
+		if (!search) return catChangedErr; // finished, or made way for a newer one
+
+		memcpy(&pos, pb->ioCatPosition.priv, sizeof pos);
+		if (search->generation != catGeneration) {
+			catForget(search, pos.head);
+			return catChangedErr;
+		}
+	}
+	search->used = ++catUses;
+
+	OSErr err = eofErr; // unless we stop early
+
+	while (pos.head < search->tail) {
+		int32_t *queued = HTlookup('Q', &(uint32_t){catKey(search, pos.head)}, 4);
+		if (!queued) return catChangedErr; // an old position, already dequeued
+		int32_t dircnid = *queued;
+
+		// Directory might have gone away since it was queued
+		if (iserr(browse(DIRFID, dircnid, "")) ||
+			Walk9(DIRFID, LISTFID, 0, NULL, NULL, NULL) ||
+			Lopen9(LISTFID, O_RDONLY|O_DIRECTORY, NULL, NULL)
+		) {
+			HTdelete('Q', &(uint32_t){catKey(search, pos.head)}, 4);
+			pos.head++;
+			pos.offset = 0;
+			continue;
+		}
+
+		char scratch[8192];
+		InitReaddir9(LISTFID, scratch, sizeof scratch);
+		SeekReaddir9(scratch, pos.offset);
+
+		struct Qid9 qid;
+		char type;
+		char name[512];
+		bool stop = false;
+
+		for (;;) {
+			// Check for room up front, to stop between entries and not during one
+			// (fsCall will get the system task to enlarge the table)
+			if (!HTroom(4, 4+sizeof name)) {
+				err = noErr;
+				stop = true;
+				break;
+			}
+
+			if (Readdir9(scratch, &qid, &type, name)) break;
+			if (!visName(name)) continue;
+
+			qid = qidTypeFix(qid, type);
+			int32_t cnid = qid2cnid(qid);
+
+			if (isdir(cnid)) {
+				setDB(cnid, dircnid, name);
+				HTinstall('Q', &(uint32_t){catKey(search, search->tail)}, 4, &cnid, 4);
+				search->tail++;
+			}
+
+			if (catMatch(pb, cnid, dircnid, name, DIRFID)) {
+				setDB(cnid, dircnid, name);
+
+				struct FSSpec *spec = &pb->ioMatchPtr[pb->ioActMatchCount++];
+				spec->vRefNum = vcb.vcbVRefNum;
+				spec->parID = dircnid;
+				mr31name(spec->name, name);
+			}
+
+			if (pb->ioActMatchCount >= pb->ioReqMatchCount ||
+				(limit && LMGetTicks() - start >= limit)
+			) {
+				err = noErr;
+				stop = true;
+				break;
+			}
+		}
+
+		pos.offset = TellReaddir9(scratch);
+		Clunk9(LISTFID);
 
+		if (stop) break;
+
+		HTdelete('Q', &(uint32_t){catKey(search, pos.head)}, 4);
+		pos.head++;
+		pos.offset = 0;
+	}
+
+	pb->ioCatPosition.initialize = search->id;
+	memcpy(pb->ioCatPosition.priv, &pos, sizeof pos);
+
+	if (err == eofErr) search->id = 0; // the queue is empty, so the slot is free
+
+	return err;
+}
+
+static bool catMatch(struct CSParam *pb, int32_t cnid, int32_t parent, const char *name, uint32_t dirfid) {
+	enum {ITEMFID = 16};
+	enum {
+		NAMEBITS = fsSBPartialName | fsSBFullName,
+		FILEBITS = fsSBFlLgLen | fsSBFlPyLen | fsSBFlRLgLen | fsSBFlRPyLen,
+		DIRBITS = fsSBDrNmFls,
+		// These need GetCatInfo-style round trips, so check them last
+		INFOBITS = FILEBITS | DIRBITS | fsSBFlFndrInfo | fsSBFlXFndrInfo |
+			fsSBFlCrDat | fsSBFlMdDat | fsSBFlBkDat,
+	};
+
+	long bits = pb->ioSearchBits;
+	struct HFileInfo *lo = &pb->ioSearchInfo1->hFileInfo;
+	struct HFileInfo *hi = &pb->ioSearchInfo2->hFileInfo; // upper bound or mask
+	bool dir = isdir(cnid);
+	bool match = true;
+
+	// Some criteria only make sense for files, or only for directories
+	if (dir && (bits & FILEBITS)) match = false;
+	if (!dir && (bits & DIRBITS)) match = false;
+
+	if (match && (bits & NAMEBITS)) {
+		unsigned char roman[32];
+		mr31name(roman, name);
+		match = catMatchName(roman, lo->ioNamePtr, (bits & fsSBFullName) == 0);
+	}
+
+	if (match && (bits & fsSBFlParID)) {
+		match = parent >= lo->ioFlParID && parent <= hi->ioFlParID;
+	}
+
+	// Attribute bits other than the directory bit need the full info
+	bool needInfo = (bits & INFOBITS) ||
+		((bits & fsSBFlAttrib) && (hi->ioFlAttrib & ~ioDirMask));
+
+	if (match && (bits & fsSBFlAttrib) && !needInfo) {
+		match = (((dir ? ioDirMask : 0) ^ lo->ioFlAttrib) & hi->ioFlAttrib) == 0;
+	}
+
+	if (match && needInfo) {
+		// Exactly what GetCatInfo would return (directory and file layouts coincide)
+		CInfoPBRec info = {.hFileInfo = {.ioTrap = 0xa260}};
+		struct HFileInfo *f = &info.hFileInfo;
+
+		setDB(cnid, parent, name); // so setFilePBInfo can find the sidecars
+		struct Qid9 qid;
+		if (Walk9(dirfid, ITEMFID, 1, (const char *[]){name}, NULL, &qid)) return false;
+		if (dir) {
+			setDirPBInfo(&info.dirInfo, cnid, ITEMFID);
+		} else {
+			setFilePBInfo(f, cnid, ITEMFID, qid);
+		}
+
+#define INRANGE(field) (f->field >= lo->field && f->field <= hi->field)
+#define MASKEQ(field) catMaskEqual(&f->field, &lo->field, &hi->field, sizeof f->field)
+		if ((bits & fsSBFlAttrib) && ((f->ioFlAttrib ^ lo->ioFlAttrib) & hi->ioFlAttrib)) match = false;
+		if ((bits & fsSBFlFndrInfo) && !MASKEQ(ioFlFndrInfo)) match = false;
+		if ((bits & fsSBFlXFndrInfo) && !MASKEQ(ioFlXFndrInfo)) match = false;
+		if ((bits & fsSBFlLgLen) && !INRANGE(ioFlLgLen)) match = false;
+		if ((bits & fsSBFlPyLen) && !INRANGE(ioFlPyLen)) match = false;
+		if ((bits & fsSBFlRLgLen) && !INRANGE(ioFlRLgLen)) match = false;
+		if ((bits & fsSBFlRPyLen) && !INRANGE(ioFlRPyLen)) match = false;
+		if ((bits & fsSBFlCrDat) && !INRANGE(ioFlCrDat)) match = false;
+		if ((bits & fsSBFlMdDat) && !INRANGE(ioFlMdDat)) match = false;
+		if ((bits & fsSBFlBkDat) && !INRANGE(ioFlBkDat)) match = false;
+		if ((bits & fsSBDrNmFls) && !INRANGE(ioFlStBlk)) match = false; // = ioDrNmFls
+#undef INRANGE
+#undef MASKEQ
+	}
+
+	return match != ((bits & fsSBNegate) != 0);
+}
+
+// Case-insensitive like HFS, but only folding ASCII letters
+static bool catMatchName(const unsigned char *name, const unsigned char *want, bool partial) {
+	if (want == NULL) return false;
+
+	int last = partial ? name[0] - want[0] : 0;
+	if (!partial && name[0] != want[0]) return false;
+
+	for (int start=0; start<=last; start++) {
+		int i;
+		for (i=0; i<want[0]; i++) {
+			unsigned char a = name[1+start+i], b = want[1+i];
+			if (a >= 'a' && a <= 'z') a -= 'a' - 'A';
+			if (b >= 'a' && b <= 'z') b -= 'a' - 'A';
+			if (a != b) break;
+		}
+		if (i == want[0]) return true;
+	}
+	return false;
+}
+
+static bool catMaskEqual(const void *val, const void *want, const void *mask, size_t len) {
+	for (size_t i=0; i<len; i++) {
+		if ((((const char *)val)[i] ^ ((const char *)want)[i]) & ((const char *)mask)[i]) return false;
+	}
+	return true;
+}
+
+static int32_t browse(uint32_t fid, int32_t cnid, const unsigned char *paspath) {
 	if (paspath == NULL) paspath = "";
 
 	if (isAbs(paspath) || cnid == 1 /*"parent of root"*/) {
@@ -1430,6 +1944,7 @@ static int32_t browse(uint32_t fid, int32_t cnid, const unsigned char *paspath)
 	// Fast case: root only
 	if (pathCompCnt == 0) {
 		Walk9(ROOTFID, fid, 0, NULL, NULL, NULL); // dupe shouldn't fail
+		browseQid = root;
 		return 2;
 	}
 
@@ -1528,7 +2043,18 @@ static int32_t browse(uint32_t fid, int32_t cnid, const unsigned char *paspath)
 			}
 			Clunk9(27);
 
-			if (err != 0) return fnfErr;
+			if (err == -1) {
+				// The CNID is not in its parent any more (a stale database entry)
+				if (wantCNID) forgetDB(wantCNID);
+				return fnfErr;
+			} else if (err != 0) {
+				return ioErr; // the listing failed, which says nothing about the database
+			}
+
+			// The CNID was found under a different name (renamed on the host)
+			if (wantCNID && strcmp(filename, wantName)) {
+				setDB(wantCNID, curDepth ? qid2cnid(qids[curDepth-1]) : 2, filename);
+			}
 
 			if (Walk9(tip, fid, 1, (const char *[]){filename}, NULL, NULL))
 				return fnfErr;
@@ -1571,32 +2097,51 @@ static int32_t browse(uint32_t fid, int32_t cnid, const unsigned char *paspath)
 		}
 	}
 
-	return qid2cnid(qids[pathCompCnt-1]);
+	browseQid = qids[pathCompCnt-1];
+	return qid2cnid(browseQid);
 }
 
-// Erase the global path variables and set them to the known path of a CNID
-static bool setPath(int32_t cnid) {
-	int nbytes = 0;
-	int npath = 0;
+// Getattr9 on a fid known (by a recent walk) to have this qid
+static int getattrCached(uint32_t fid, struct Qid9 qid, struct Stat9 *ret) {
+	unsigned long now = LMGetTicks();
+
+	for (int i=0; i<ATTRCACHE; i++) {
+		struct attrEntry *e = &attrCache[i];
+		if (e->stat.qid.path != qid.path || e->stat.qid.version != qid.version) continue;
+		if (e->ticks == 0) continue; // forgotten
+		if (attrTTL >= 0 && now - e->ticks >= attrTTL) continue;
 
-	// Preflight: number of components and their total length
-	for (int32_t i=cnid; i!=2; i=getDBParent(i)) {
-		if (i == 0) return true; // bad cnid
-		nbytes += strlen(getDBName(i)) + 1;
-		npath++;
+		*ret = e->stat;
+		return 0;
 	}
 
-	pathBlobSize = nbytes;
-	pathCompCnt = npath;
+	int err = Getattr9(fid, STAT_ALL, ret);
+	if (err) return err;
 
-	for (int32_t i=cnid; i!=2; i=getDBParent(i)) {
-		npath--;
-		expectCNID[npath] = i;
-		const char *name = getDBName(i);
-		nbytes -= strlen(name) + 1;
-		pathComps[npath] = strcpy(pathBlob + nbytes, name);
+	// Replace round-robin, after removing any stale copy
+	forgetAttr(qid2cnid(ret->qid));
+	attrCache[attrCacheNext] = (struct attrEntry){now ? now : 1, *ret};
+	attrCacheNext = (attrCacheNext + 1) % ATTRCACHE;
+	return 0;
+}
+
+// Our own write has changed the file
+static void forgetAttr(int32_t cnid) {
+	for (int i=0; i<ATTRCACHE; i++) {
+		if (attrCache[i].ticks && qid2cnid(attrCache[i].stat.qid) == cnid) {
+			attrCache[i].ticks = 0;
+		}
 	}
+}
+
+// Erase the global path variables and set them to the known path of a CNID
+static bool setPath(int32_t cnid) {
+	int nbytes = sizeof pathBlob;
+	int npath = pathDB(cnid, pathBlob, &nbytes, pathComps, expectCNID, sizeof pathComps / sizeof *pathComps);
+	if (npath < 0) return true; // bad cnid
 
+	pathBlobSize = nbytes;
+	pathCompCnt = npath;
 	return false;
 }
 
@@ -1730,15 +2275,16 @@ static void cnidPrint(int32_t cnid) {
 	int remain = sizeof big;
 
 	while (cnid != 2) {
-		const char *name = getDBName(cnid);
-		int nsize = strlen(name);
-		if (remain < nsize+1) break;
+		int32_t parent;
+		int nsize;
+		const char *name = getDBEntry(cnid, &parent, &nsize);
+		if (!name || remain < nsize+1) break;
 
 		remain -= nsize;
 		memcpy(big + remain, name, nsize);
 		big[--remain] = '/';
 
-		cnid = getDBParent(cnid);
+		cnid = parent;
 	}
 
 	if (remain == sizeof big) big[--remain] = '/'; // root is not "empty path"
@@ -1823,43 +2369,189 @@ static bool visName(const char *name) {
 	return true;
 }
 
-// Hash table accessors, tuned to minimise slot usage
+// Open the snapshot as DBFID and check its header, false if there isn't one
+static bool openDB(struct dbHeader *hdr) {
+	if (Walk9(ROOTFID, DBFID, 1, (const char *[]){DBNAME}, NULL, NULL)) return false;
+	if (Lopen9(DBFID, O_RDONLY, NULL, NULL)) {
+		Clunk9(DBFID);
+		return false;
+	}
 
-struct rec {
-	int32_t parent;
-	char name[512];
-};
+	uint32_t got;
+	if (Read9(DBFID, hdr, 0, sizeof *hdr, &got) || got != sizeof *hdr ||
+		hdr->magic != DBMAGIC || hdr->version != DBVERSION
+	) {
+		printf("CNID database: bad snapshot, ignoring\n");
+		Clunk9(DBFID);
+		return false;
+	}
+
+	if (hdr->rootpath != root.path) {
+		printf("CNID database: snapshot is of another share, ignoring\n");
+		Clunk9(DBFID);
+		return false;
+	}
+
+	return true;
+}
+
+// Size the hash table for the files on the share in one go, instead of letting
+// it double many times during the first Finder session
+// A snapshot says how many CNIDs the last session knew, plus some headroom for
+// what this one will add. Without one there is only the host's inode count,
+// which covers its whole filesystem and might be much bigger than the share,
+// so that estimate is capped.
+// Must only be called when moving memory is safe
+static void presizeDB(uint32_t snapshot) {
+	enum {
+		MAXESTIMATE = 16384, // 1 MB of table at most, when guessing
+		PERCNID = 1, // '$' entry, a shared name adds 'I' and 'N' once
+		BYTESPERCNID = 24, // '$' record with a typical name
+	};
+
+	uint64_t files;
+	if (snapshot) {
+		files = snapshot + snapshot/4;
+	} else {
+		struct Statfs9 sfs;
+		if (Statfs9(ROOTFID, &sfs)) return;
+
+		files = sfs.files - sfs.ffree;
+		if (sfs.ffree > sfs.files) files = 0; // garbage
+		if (files > MAXESTIMATE) files = MAXESTIMATE;
+	}
+	printf("CNID database: presizing for %lu files\n", (uint32_t)files);
 
-static void setDB(int32_t cnid, int32_t pcnid, const char *name) {
-	struct rec rec;
-	rec.parent = pcnid;
-	strcpy(rec.name, name);
+	HTreserve(files * PERCNID, files * BYTESPERCNID);
+}
+
+// Read the snapshot opened by openDB into the database, then close it,
+// not overriding anything newer
+// Entries are only checked against the real qids when browse() uses them
+// Must only be called when moving memory is safe
+static void loadDB(const struct dbHeader *hdr) {
+	enum {RECMAX = 10 + 511};
+
+	char buf[4096];
+	uint64_t pos = sizeof *hdr;
+	uint32_t have = 0, used = 0, loaded = 0, got;
+	bool dirty = dbDirty; // loading the snapshot is not a change
+
+	for (uint32_t i=0; i<hdr->count; i++) {
+		// Keep at least one whole record in the buffer
+		if (have - used < RECMAX) {
+			memmove(buf, buf + used, have - used);
+			have -= used;
+			used = 0;
+			if (Read9(DBFID, buf + have, pos, sizeof buf - have, &got)) break;
+			pos += got;
+			have += got;
+		}
 
-	// Cast away the const -- but the name should not be modified by us
-	HTinstall('$', &cnid, sizeof cnid, &rec, 4+strlen(name)+1); // dodgy size calc
+		int32_t cnid, parent;
+		char name[512];
+		uint16_t nlen;
+		if (have - used < 10) break; // truncated
+		memcpy(&cnid, buf + used, 4);
+		memcpy(&parent, buf + used + 4, 4);
+		memcpy(&nlen, buf + used + 8, 2);
+		if (nlen > 511 || have - used < 10 + nlen) break;
+		memcpy(name, buf + used + 10, nlen);
+		name[nlen] = 0;
+		used += 10 + nlen;
+
+		if (getDBParent(cnid) != 0) continue; // learned this boot, keep it
+
+		HTallocate(); // grows the table only when it is half full
+		if (!roomDB(nlen)) break;
+		setDB(cnid, parent, name);
+		loaded++;
+	}
+
+	dbDirty = dirty;
+	Clunk9(DBFID);
+	printf("CNID database: loaded %lu of %lu entries\n", loaded, hdr->count);
 }
 
-// NULL on failure (bad CNID)
-static const char *getDBName(int32_t cnid) {
-	struct rec *rec = HTlookup('$', &cnid, sizeof cnid);
-	if (!rec) return NULL;
-	return rec->name;
+// Write the database to a temporary file, then rename over the old snapshot
+// Does nothing if unchanged since the last save, or if the share is read-only
+static void saveDB(void) {
+	if (!dbDirty || dbReadOnly) return;
+
+	Walk9(ROOTFID, DBFID, 0, NULL, NULL, NULL); // dupe shouldn't fail
+	if (Lcreate9(DBFID, O_WRONLY|O_TRUNC|O_CREAT, 0666, 0, DBTEMP, NULL, NULL)) {
+		printf("CNID database: cannot save snapshot, share read-only?\n");
+		dbReadOnly = true;
+		return;
+	}
+
+	struct dbHeader hdr = {
+		.magic = DBMAGIC,
+		.version = DBVERSION,
+		.rootpath = root.path,
+	};
+
+	char buf[4096];
+	uint64_t pos = sizeof hdr; // header goes last, when the count is known
+	uint32_t used = 0, got;
+	bool err = false;
+
+	size_t cursor = 0;
+	int32_t cnid;
+	while (!err && nextDB(&cursor, &cnid)) {
+		// The root's name comes from the mount_tag, and skip forgotten CNIDs
+		if (cnid == 2 || !connectedDB(cnid)) continue;
+
+		int32_t parent;
+		int len;
+		const char *name = getDBEntry(cnid, &parent, &len);
+		uint16_t nlen = len;
+		if (used + 10 + nlen > sizeof buf) {
+			err = Write9(DBFID, buf, pos, used, &got) || got != used;
+			pos += used;
+			used = 0;
+		}
+
+		memcpy(buf + used, &cnid, 4);
+		memcpy(buf + used + 4, &parent, 4);
+		memcpy(buf + used + 8, &nlen, 2);
+		memcpy(buf + used + 10, name, nlen);
+		used += 10 + nlen;
+		hdr.count++;
+	}
+
+	if (!err && used) err = Write9(DBFID, buf, pos, used, &got) || got != used;
+	if (!err) err = Write9(DBFID, &hdr, 0, sizeof hdr, &got) || got != sizeof hdr;
+	Clunk9(DBFID);
+
+	if (err || Renameat9(ROOTFID, DBTEMP, ROOTFID, DBNAME)) {
+		printf("CNID database: failed to save snapshot\n");
+		Unlinkat9(ROOTFID, DBTEMP, 0);
+		return;
+	}
+
+	printf("CNID database: saved %lu entries\n", hdr.count);
+	dbDirty = false;
+	dbSaveTicks = LMGetTicks();
 }
 
-// Zero on failure (bad CNID)
-static int32_t getDBParent(int32_t cnid) {
-	struct rec *rec = HTlookup('$', &cnid, sizeof cnid);
-	if (!rec) return 0;
-	return rec->parent;
+static struct forks getOpenForks(int32_t cnid) {
+	struct forks *forks = HTlookup('F', &cnid, sizeof cnid);
+	if (!forks) return (struct forks){0, 0};
+	return *forks;
 }
 
-static long fsCall(void *pb, long selector, void *stack) {
-	static unsigned char hdr;
-	if (hdr++ == 0) {
-		printf("%lu%% (browse/total) %d%% (relist/total)\n", browseTimer*100/(hfsTimer+1), relistTimer*100/(hfsTimer+1));
+static void setOpenForks(int32_t cnid, struct forks forks) {
+	if (forks.data || forks.rsrc) {
+		HTinstall('F', &cnid, sizeof cnid, &forks, sizeof forks);
+	} else {
+		HTdelete('F', &cnid, sizeof cnid);
 	}
+}
 
-	TIMEFUNC(hfsTimer);
+static long fsCall(void *pb, long selector, void *stack) {
+	uint32_t startTime = profNow();
+	uint32_t startTrips = Roundtrips9;
 
 	// Hideously nasty stack-sniffing debug code
 // 	void *top = LMGetMemTop() - 32;
@@ -1896,6 +2588,8 @@ static long fsCall(void *pb, long selector, void *stack) {
 		strcat(logprefix, "     ");
 	}
 
+	struct traceRec *trace = traceStart(pb, selector, startTime);
+
 	OSErr result = fsDispatch(pb, selector);
 
 	if (logenable) {
@@ -1903,9 +2597,118 @@ static long fsCall(void *pb, long selector, void *stack) {
 		printf("%s", PBPrint(pb, selector, result));
 	}
 
+	uint32_t elapsed = profNow() - startTime;
+	profRecord(profile, selector & 0xf0ff, elapsed, Roundtrips9 - startTrips);
+	if (trace) traceFinish(trace, pb, result, elapsed, Roundtrips9 - startTrips);
 	return result;
 }
 
+// Claim the next ring slot and fill in the inputs, NULL if not tracing
+static struct traceRec *traceStart(void *pb, unsigned short selector, uint32_t start) {
+	if (!traceBuf) return NULL;
+
+	struct IOParam *io = pb;
+	struct traceRec *rec = &traceBuf[traceCount++ % TRACERECS];
+	memset(rec, 0, sizeof *rec);
+
+	rec->selector = selector & 0xf0ff;
+	rec->start = start;
+	rec->vRefNum = io->ioVRefNum;
+	rec->refNum = io->ioRefNum;
+
+	// ioNamePtr is not an input to refnum calls, so it may be garbage
+	if (!isRefNumCall(selector)) {
+		if (io->ioNamePtr) {
+			int len = io->ioNamePtr[0];
+			if (len > sizeof rec->name - 1) len = sizeof rec->name - 1;
+			rec->name[0] = len;
+			memcpy(rec->name + 1, io->ioNamePtr + 1, len);
+		}
+
+		rec->dirID = ((struct HFileParam *)pb)->ioDirID;
+	}
+
+	return rec;
+}
+
+static void traceFinish(struct traceRec *rec, void *pb, OSErr result, uint32_t duration, uint32_t roundtrips) {
+	rec->result = result;
+	rec->duration = duration;
+	rec->roundtrips = roundtrips > 0xffff ? 0xffff : roundtrips;
+
+	if (isRefNumCall(rec->selector)) {
+		struct IOParam *io = pb;
+		rec->count = io->ioReqCount;
+		rec->actual = io->ioActCount;
+		rec->position = io->ioPosOffset;
+	} else {
+		rec->outDirID = ((struct HFileParam *)pb)->ioDirID;
+	}
+}
+
+// These have an IOParam and no ioDirID field
+static bool isRefNumCall(unsigned short selector) {
+	switch (selector & 0xf0ff) {
+	case kFSMClose: case kFSMRead: case kFSMWrite: case kFSMAllocate:
+	case kFSMGetEOF: case kFSMSetEOF: case kFSMGetFPos: case kFSMSetFPos:
+	case kFSMFlushFile:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Oldest record first, then forget them
+static void traceFlush(bool toFile) {
+	enum {TRACEFID = 23};
+
+	uint32_t n = traceCount < TRACERECS ? traceCount : TRACERECS;
+	uint32_t first = traceCount - n;
+
+	if (toFile) {
+		if (Walk9(ROOTFID, TRACEFID, 1, (const char *[]){TRACENAME}, NULL, NULL) ||
+			Lopen9(TRACEFID, O_WRONLY|O_APPEND, NULL, NULL)
+		) {
+			Walk9(ROOTFID, TRACEFID, 0, NULL, NULL, NULL); // dupe shouldn't fail
+			if (Lcreate9(TRACEFID, O_WRONLY|O_APPEND|O_CREAT, 0666, 0, TRACENAME, NULL, NULL)) {
+				printf("Trace: cannot open " TRACENAME "\n");
+				return;
+			}
+		}
+
+		// At most two contiguous runs (the ring wraps), each in Max9-sized writes
+		// A short write is retried from where it stopped, so records stay whole
+		uint32_t bytes = n * sizeof (struct traceRec);
+		uint32_t done = 0;
+		while (done < bytes) {
+			uint32_t slot = (first + done / sizeof (struct traceRec)) % TRACERECS;
+			uint32_t within = done % sizeof (struct traceRec);
+			uint32_t run = (TRACERECS - slot) * sizeof (struct traceRec) - within;
+			if (run > bytes - done) run = bytes - done;
+			if (run > Max9) run = Max9;
+
+			uint32_t got;
+			if (Write9(TRACEFID, (char *)&traceBuf[slot] + within, 0 /*appending*/, run, &got) || got == 0) {
+				printf("Trace: write failed after %lu bytes\n", done);
+				break;
+			}
+			done += got;
+		}
+
+		Clunk9(TRACEFID);
+	} else {
+		for (uint32_t i=0; i<n; i++) {
+			unsigned char *rec = (void *)&traceBuf[(first + i) % TRACERECS];
+			printf("Trace: ");
+			for (int j=0; j<sizeof (struct traceRec); j++) printf("%02x", rec[j]);
+			printf("\n");
+		}
+	}
+
+	printf("Trace: flushed %lu records (%lu lost to wraparound)\n", n, first);
+	traceCount = 0;
+}
+
 // This makes it easy to have a selector return noErr without a function
 static OSErr fsDispatch(void *pb, unsigned short selector) {
 	switch (selector & 0xf0ff) {
@@ -1920,12 +2723,12 @@ static OSErr fsDispatch(void *pb, unsigned short selector) {
 	case kFSMRename: return fsRename(pb);
 	case kFSMGetFileInfo: return fsGetFileInfo(pb);
 	case kFSMSetFileInfo: return fsSetFileInfo(pb);
-	case kFSMUnmountVol: return extFSErr;
+	case kFSMUnmountVol: return fsUnmountVol(pb);
 	case kFSMMountVol: return fsMountVol(pb);
 	case kFSMAllocate: return noErr;
 	case kFSMGetEOF: return fsGetEOF(pb);
 	case kFSMSetEOF: return fsSetEOF(pb);
-	case kFSMFlushVol: return noErr;
+	case kFSMFlushVol: return fsFlushVol(pb);
 	case kFSMGetVol: return extFSErr; // FM handles
 	case kFSMSetVol: return fsSetVol(pb);
 	case kFSMEject: return extFSErr;
@@ -1943,7 +2746,7 @@ static OSErr fsDispatch(void *pb, unsigned short selector) {
 	case kFSMGetWDInfo: return noErr;
 	case kFSMGetFCBInfo: return noErr;
 	case kFSMGetCatInfo: return fsGetFileInfo(pb);
-	case kFSMSetCatInfo: return noErr;
+	case kFSMSetCatInfo: return fsSetFileInfo(pb);
 	case kFSMSetVolInfo: return noErr;
 	case kFSMLockRng: return extFSErr;
 	case kFSMUnlockRng: return extFSErr;
@@ -1952,7 +2755,7 @@ static OSErr fsDispatch(void *pb, unsigned short selector) {
 	case kFSMDeleteFileIDRef: return extFSErr;
 	case kFSMResolveFileIDRef: return extFSErr;
 	case kFSMExchangeFiles: return extFSErr;
-	case kFSMCatSearch: return extFSErr;
+	case kFSMCatSearch: return fsCatSearch(pb);
 	case kFSMOpenDF: return fsOpen(pb);
 	case kFSMMakeFSSpec: return fsMakeFSSpec(pb);
 	case kFSMDTGetPath: return extFSErr;
@@ -2116,6 +2919,54 @@ static OSErr dgDeviceType(struct DriverGestaltParam *pb) {
 	return noErr;
 }
 
+// Attribute cache lifetime in ticks (-1 = forever, 0 = no caching)
+static OSErr dcAttrTTL(struct DriverGestaltParam *pb) {
+	attrTTL = pb->driverGestaltResponse;
+	memset(attrCache, 0, sizeof attrCache);
+	return noErr;
+}
+
+static OSErr dgAttrTTL(struct DriverGestaltParam *pb) {
+	pb->driverGestaltResponse = attrTTL;
+	return noErr;
+}
+
+// Dump the fsCall profile to the log and start afresh
+static OSErr dcProfile(struct DriverGestaltParam *pb) {
+	profDump(profile, "9P");
+	memset(profile, 0, sizeof profile);
+	return noErr;
+}
+
+// Start, stop or flush the fsCall trace (argument is TRACEON etc)
+// Starting and stopping call the Memory Manager, so must be synchronous
+static OSErr dcTrace(struct DriverGestaltParam *pb) {
+	switch (pb->driverGestaltResponse) {
+	case TRACEON:
+		if (traceBuf) return noErr;
+		if (pb->ioTrap & 0x400) return controlErr;
+		traceBuf = (void *)NewPtrSysClear(TRACERECS * sizeof (struct traceRec));
+		traceCount = 0;
+		return traceBuf ? noErr : memFullErr;
+	case TRACEOFF:
+		if (pb->ioTrap & 0x400) return controlErr;
+		if (traceBuf) DisposePtr((void *)traceBuf);
+		traceBuf = NULL;
+		return noErr;
+	case TRACELOG: case TRACEFILE:
+		if (traceBuf) traceFlush(pb->driverGestaltResponse == TRACEFILE);
+		return noErr;
+	default:
+		return paramErr;
+	}
+}
+
+// Pointer to the live profile, an array of PROFSLOTS struct profSlot (timing.h)
+static OSErr dgProfile(struct DriverGestaltParam *pb) {
+	pb->driverGestaltResponse = (long)profile;
+	return noErr;
+}
+
 static OSErr controlStatusCall(struct CntrlParam *pb) {
 	// Coerce csCode or driverGestaltSelector into one long
 	// Negative is Status/DriverGestalt, positive is Control/DriverConfigure
@@ -2142,6 +2993,11 @@ static OSErr controlStatusDispatch(long selector, void *pb) {
  	case -'dvrf': return dgDeviceReference(pb);
 	case -'intf': return dgInterface(pb);
  	case -'devt': return dgDeviceType(pb);
+	case 'attl': return dcAttrTTL(pb);
+	case -'attl': return dgAttrTTL(pb);
+	case 'prof': return dcProfile(pb);
+	case -'prof': return dgProfile(pb);
+	case 'trce': return dcTrace(pb);
 	default:
 		if (selector > 0) {
 			return controlErr;
@@ -39,9 +39,20 @@
 enum {
 	MAXBUF = 64*1024*1024, // enough for 4096x4096
 	MINBUF = 2*1024*1024, // enough for 800x600
-	FAST_REFRESH = -16626, // before QD callbacks work, microsec, 60.15 Hz
-	SLOW_REFRESH = 1000, // after QD callbacks work, millisec, 1 Hz
+	FAST_REFRESH = -16626, // VBL interval, microsec, 60.15 Hz
+	SLOW_REFRESH = 60, // full refreshes while damage is untrusted, in VBLs, 1 Hz
 	CURSOREDGE = 16,
+	HOSTCURSOREDGE = 64, // virtio-gpu cursor resources are always 64x64
+	CURSORSLOT = 64, // bytes per cursor queue command in lpage
+	MAXRECTS = 8, // separate transfers per screen update
+	TILESHIFT = 5, // 32x32-pixel tiles for damage tracking
+	MAXTILES = 8192 >> TILESHIFT, // across or down
+};
+
+// Disjoint rects, each sent as its own transfer
+struct rects {
+	short n;
+	struct {short t, l, b, r;} r[MAXRECTS];
 };
 
 enum {
@@ -61,18 +72,27 @@ static OSStatus finalize(DriverFinalInfo *info);
 static OSStatus control(short csCode, void *param);
 static OSStatus status(short csCode, void *param);
 static void transact(void *req, size_t req_size, void *reply, size_t reply_size);
+static void transactChain(int n, void **reqs, size_t *req_sizes, void **replies, size_t *reply_sizes);
 static void getSuggestedSizes(struct virtio_gpu_display_one pmodes[16]);
 static void getBestSize(short *width, short *height);
 static uint32_t idForRes(short width, short height, bool force);
 static uint32_t resCount(void);
 static bool mode(int new_depth, uint32_t new_rez);
-static uint32_t setVirtioScanout(int idx, short rowbytes, short w, short h, uint32_t *page_list);
+static uint32_t setVirtioScanout(int idx, uint32_t format, short rowbytes, short w, short h, uint32_t *page_list);
 static void notificationProc(NMRecPtr nmReqPtr);
 static void notificationAtomic(NMRecPtr nmReqPtr);
 static void debugPoll(void);
 static void lateBootHook(void);
 static void updateScreen(short t, short l, short b, short r);
 static void sendPixels(uint32_t topleft, uint32_t botright);
+static void markTiles(short t, short l, short b, short r);
+static void clearTiles(void);
+static void addRect(struct rects *list, short t, short l, short b, short r);
+static void blitRect(short t, short l, short b, short r);
+static void sendRects(struct rects *list);
+static void flushDamage(void);
+static void softCursorDamage(void);
+static bool damageTrusted(void);
 static void perfTest(void);
 static OSStatus VBL(void *p1, void *p2);
 static long rowbytesForBack(int relativeDepth, long width);
@@ -118,17 +138,27 @@ static OSStatus SetHardwareCursor(VDSetHardwareCursorRec *rec);
 static OSStatus DrawHardwareCursor(VDDrawHardwareCursorRec *rec);
 static void gammaCursor(void);
 static void blitCursor(void);
+static bool initHostCursor(void);
+static void uploadCursor(void);
+static void sendCursor(void);
 
 // Allocate one 4096-byte page for all our screen-update buffers.
 // (16 is the maximum number of 192-byte chunks fitting in a page)
+// The last 1024 bytes hold up to 16 cursor queue commands.
 static void *lpage;
 static uint32_t ppage;
 static int maxinflight = 16;
 static uint16_t freebufs;
+static uint16_t freecursbufs;
 
-// Allocate two large framebuffers
+// Allocate two large framebuffers, both wired so either can back the resource
+// Zero-copy leaves frontbuf idle but does not free it. Leaving zero-copy would
+// mean allocating it again, perhaps where memory can't be allocated (a host
+// resize is handled at secondary interrupt time), perhaps after an application
+// has taken the memory. So zero-copy saves the blit, not memory.
 static void *backbuf, *frontbuf;
 static size_t bufsize;
+static uint32_t backpages[MAXBUF/4096];
 static uint32_t fbpages[MAXBUF/4096];
 static uint32_t screen_resource = 100;
 
@@ -148,11 +178,18 @@ static short W, H, rowbytes_back, rowbytes_front;
 static int depth;
 static ColorSpec public_clut[256];
 static uint32_t private_clut[256];
+static uint32_t private_clut15[32768]; // thousands of colors, see BlitTable15
 
 static uint8_t gamma_red[256];
 static uint8_t gamma_grn[256];
 static uint8_t gamma_blu[256];
 static char gamma_public[1024];
+static bool gamma_identity;
+
+// At 32 bits with uncorrected gamma, QuickDraw's pixels are already in a
+// format the host understands (X8R8G8B8), so it scans out backbuf directly
+// (but see zerocopyWanted)
+static bool zerocopy;
 
 // Fake vertical blanking interrupts
 static InterruptServiceIDType vblservice;
@@ -161,6 +198,14 @@ static TimerID vbltimer;
 static bool vblon = true;
 static bool qdworks;
 
+// Screen damage reported by QuickDraw, sent by the next VBL
+// (one bit per tile, most significant bit leftmost)
+static uint32_t dirtytiles[MAXTILES][MAXTILES/32];
+static bool dmg_trusted; // as of the last VBL
+static int dmg_untrusted_vbls;
+
+static struct rects unsent; // waiting for free buffers (see sendPixels)
+
 static bool pending_notification; // deduplicate NMInstall
 static bool change_in_progress; // SetMode/SwitchMode lock out frame interrupts
 
@@ -172,6 +217,17 @@ static short curs_t, curs_l, curs_b, curs_r;
 static uint32_t curs_back[CURSOREDGE*CURSOREDGE];
 static uint32_t curs_front[CURSOREDGE*CURSOREDGE];
 
+// Or the host draws the cursor on its own plane (not for inverting cursors)
+static bool hostcursor; // the device has a cursor queue and we have a resource
+static bool curs_hw; // the current cursor is on the host plane
+static bool curs_hw_stale; // next command must be UPDATE_CURSOR not MOVE_CURSOR
+static bool curs_hw_pending; // state not sent yet for want of a buffer
+static bool curs_hot_stale; // find the hotspot at the next DrawHardwareCursor
+static short curs_hot_x, curs_hot_y;
+static void *cursbuf;
+static uint32_t cursbufpages[HOSTCURSOREDGE*HOSTCURSOREDGE*4/4096];
+static uint32_t cursor_resource = 99;
+
 DriverDescription TheDriverDescription = {
 	kTheDescriptionSignature,
 	kInitialDriverDescriptor,
@@ -323,7 +379,7 @@ extern OSStatus DoDriverIO(AddressSpaceID spaceID, IOCommandID cmdID,
 }
 
 static OSStatus initialize(DriverInitInfo *info) {
-	long ram = 0;
+	long ram = 0, features = 0;
 	short width, height;
 
 	sprintf(logprefix, "%.*s(%d) ", *drvrNameVers, drvrNameVers+1, info->refNum);
@@ -353,6 +409,9 @@ static OSStatus initialize(DriverInitInfo *info) {
 
 	freebufs = (1 << maxinflight) - 1;
 
+	// One descriptor per cursor command, and no reply
+	freecursbufs = (1 << MIN(QInit(1, 16), 16)) - 1;
+
 	// All our descriptors point into this wired-down page
 	lpage = AllocPages(1, &ppage);
 	if (lpage == NULL) {
@@ -365,14 +424,21 @@ static OSStatus initialize(DriverInitInfo *info) {
 	Gestalt('ram ', &ram);
 	while (ram != 0 && bufsize > (ram+0x10000)/8) bufsize /= 2;
 
+	// Vector blitters for thousands and millions of colors (G4 and later)
+	if (Gestalt(gestaltPowerPCProcessorFeatures, &features) == noErr &&
+			(features & (1 << gestaltPowerPCHasVectorInstructions))) {
+		printf("Using AltiVec blitters\n");
+		BlitterAltivec = 1;
+	}
+
 	// Allocate the largest two framebuffers possible
 	for (;;) {
-		backbuf = PoolAllocateResident(bufsize, true);
+		backbuf = AllocPages(bufsize/4096, backpages);
 		frontbuf = AllocPages(bufsize/4096, fbpages);
 
 		if (backbuf != NULL && frontbuf != NULL) break;
 
-		if (backbuf != NULL) PoolDeallocate(backbuf);
+		if (backbuf != NULL) FreePages(backbuf);
 		if (frontbuf != NULL) FreePages(frontbuf);
 
 		bufsize /= 2;
@@ -390,6 +456,11 @@ static OSStatus initialize(DriverInitInfo *info) {
 		panic("Could not start up in any mode");
 	}
 
+	if (freecursbufs && initHostCursor()) {
+		printf("Using the host cursor plane\n");
+		hostcursor = true;
+	}
+
 	setGammaTable((GammaTbl *)&builtinGamma[0].table);
 	linearCLUT();
 	grayPattern();
@@ -438,7 +509,7 @@ static OSStatus initialize(DriverInitInfo *info) {
 
 fail:
 	if (lpage) FreePages(lpage);
-	if (backbuf) PoolDeallocate(backbuf);
+	if (backbuf) FreePages(backbuf);
 	if (frontbuf) FreePages(frontbuf);
 	VFail();
 	return openErr;
@@ -496,21 +567,53 @@ static OSStatus status(short csCode, void *param) {
 
 // Synchronous transaction instead of the usual async queue, must not interrupt
 static void transact(void *req, size_t req_size, void *reply, size_t reply_size) {
+	transactChain(1, &req, &req_size, &reply, &reply_size);
+}
+
+// Several commands for the price of one round trip, fenced only at the end.
+// They share the screen-update part of the page (the first 3072 bytes),
+// and the host completes them in order, so the last reply means all done.
+static void transactChain(int n, void **reqs, size_t *req_sizes, void **replies, size_t *reply_sizes) {
 	uint32_t physical_bufs[2], sizes[2];
+	size_t reqoff[8], replyoff[8], off = 0;
+	int i;
 
-	physical_bufs[0] = ppage;
-	physical_bufs[1] = ppage + 2048;
-	sizes[0] = req_size;
-	sizes[1] = reply_size;
+	// A queue too short for the whole chain gets one command at a time
+	if (n > 1 && 2*n > 4*maxinflight) {
+		for (i=0; i<n; i++) transactChain(1, &reqs[i], &req_sizes[i], &replies[i], &reply_sizes[i]);
+		return;
+	}
+
+	for (i=0; i<n; i++) {
+		reqoff[i] = off;
+		off += (req_sizes[i] + 7) & ~7;
+	}
+	for (i=0; i<n; i++) {
+		replyoff[i] = off;
+		off += (reply_sizes[i] + 7) & ~7;
+	}
 
 	while (freebufs != ((1 << maxinflight) - 1)) QPoll(0);
 
-	memcpy(lpage, req, req_size);
 	last_tag = (void *)'wait';
-	QSend(0, 1, 1, physical_bufs, sizes, (void *)'done');
+	for (i=0; i<n; i++) {
+		struct virtio_gpu_ctrl_hdr *hdr = (void *)((char *)lpage + reqoff[i]);
+
+		memcpy(hdr, reqs[i], req_sizes[i]);
+		hdr->flags = (i == n-1) ? VIRTIO_GPU_FLAG_FENCE : 0;
+
+		physical_bufs[0] = ppage + reqoff[i];
+		physical_bufs[1] = ppage + replyoff[i];
+		sizes[0] = req_sizes[i];
+		sizes[1] = reply_sizes[i];
+		QSend(0, 1, 1, physical_bufs, sizes, (void *)((i == n-1) ? 'done' : 'link'));
+	}
 	QNotify(0);
 	while (last_tag != (void *)'done') QPoll(0);
-	memcpy(reply, (char *)lpage + 2048, reply_size);
+
+	for (i=0; i<n; i++) {
+		memcpy(replies[i], (char *)lpage + replyoff[i], reply_sizes[i]);
+	}
 }
 
 static void getSuggestedSizes(struct virtio_gpu_display_one pmodes[16]) {
@@ -594,25 +697,49 @@ static uint32_t resCount(void) {
 	return n;
 }
 
+// Zero-copy leaves no room for a composited cursor, and only QuickDraw can
+// take over drawing it, by way of a controlErr from SetHardwareCursor. So
+// while one is set, zero-copy waits for the next SetHardwareCursor call.
+static bool zerocopyWanted(int d) {
+	return d == k32bit && gamma_identity && !(curs_set && !curs_hw);
+}
+
 static bool mode(int new_depth, uint32_t new_rez) {
-	uint32_t resource;
+	uint32_t resource = 0;
 	short width, height;
+	bool zc = zerocopyWanted(new_depth);
 
 	width = rezzes[new_rez-1].w;
 	height = rezzes[new_rez-1].h;
 
 	change_in_progress = true;
-	resource = setVirtioScanout(0 /*scanout id*/, rowbytesForFront(new_depth, width), width, height, fbpages);
+
+	// The host might not take X8R8G8B8 (or so many extents), so fall back
+	if (zc) {
+		resource = setVirtioScanout(0 /*scanout id*/, VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM,
+			rowbytesForBack(new_depth, width), width, height, backpages);
+		zc = resource != 0;
+	}
+
+	if (!resource) {
+		resource = setVirtioScanout(0 /*scanout id*/, VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM,
+			rowbytesForFront(new_depth, width), width, height, fbpages);
+	}
+
 	if (!resource) {
 		change_in_progress = false;
 		return false;
 	}
+
+	if (zc != zerocopy) printf("Zero-copy scanout %s\n", zc ? "on" : "off");
+	zerocopy = zc;
 	screen_resource = resource;
 	W = width;
 	H = height;
 	depth = new_depth;
 	rowbytes_back = rowbytesForBack(depth, W);
 	rowbytes_front = rowbytesForFront(depth, W);
+	clearTiles();
 	change_in_progress = false;
 
 	return true;
@@ -620,15 +747,15 @@ static bool mode(int new_depth, uint32_t new_rez) {
 
 // Must be called atomically
 // Returns the resource ID, or zero if you prefer
-static uint32_t setVirtioScanout(int idx, short rowbytes, short w, short h, uint32_t *page_list) {
-	struct virtio_gpu_resource_detach_backing detach_backing = {0};
+static uint32_t setVirtioScanout(int idx, uint32_t format, short rowbytes, short w, short h, uint32_t *page_list) {
 	struct virtio_gpu_resource_create_2d create_2d = {0};
 	struct virtio_gpu_resource_attach_backing attach_backing = {0};
 	struct virtio_gpu_set_scanout set_scanout = {0};
 	struct virtio_gpu_resource_unref resource_unref = {0};
-	struct virtio_gpu_ctrl_hdr reply;
+	struct virtio_gpu_ctrl_hdr replies[3], reply;
 
 	static uint32_t res_ids[16];
+	static struct virtio_gpu_rect res_rects[16]; // of the current scanout
 	uint32_t old_resource = res_ids[idx];
 	uint32_t new_resource = res_ids[idx] ? (res_ids[idx] ^ 1) : (100 + 2*idx);
 
@@ -651,29 +778,14 @@ static uint32_t setVirtioScanout(int idx, short rowbytes, short w, short h, uint
 
 	// Create a host resource using VIRTIO_GPU_CMD_RESOURCE_CREATE_2D.
 	create_2d.hdr.type = VIRTIO_GPU_CMD_RESOURCE_CREATE_2D;
-	create_2d.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
 	create_2d.resource_id = new_resource;
-	create_2d.format = VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM;
+	create_2d.format = format;
 	create_2d.width = rowbytes/4;
 	create_2d.height = h;
 
-	transact(&create_2d, sizeof(create_2d), &reply, sizeof(reply));
-
-	// Gracefully handle host running out of room for the resource
-	if (reply.type != VIRTIO_GPU_RESP_OK_NODATA) return 0;
-
-	// Detach backing from the old resource, but don't delete it yet.
-	if (old_resource != 0) {
-		detach_backing.hdr.type = VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING;
-		detach_backing.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
-		detach_backing.resource_id = old_resource;
-
-		transact(&detach_backing, sizeof(detach_backing), &reply, sizeof(reply));
-	}
-
 	// Attach guest allocated backing memory to the resource just created.
+	// (The old resource can keep the same pages until it is unreffed.)
 	attach_backing.hdr.type = VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING;
-	attach_backing.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
 	attach_backing.resource_id = new_resource;
 	attach_backing.nr_entries = extcnt;
 
@@ -682,11 +794,8 @@ static uint32_t setVirtioScanout(int idx, short rowbytes, short w, short h, uint
 		attach_backing.entries[i].length = extents[i] * 0x1000;
 	}
 
-	transact(&attach_backing, sizeof(attach_backing), &reply, sizeof(reply));
-
 	// Use VIRTIO_GPU_CMD_SET_SCANOUT to link the framebuffer to a display scanout.
 	set_scanout.hdr.type = VIRTIO_GPU_CMD_SET_SCANOUT;
-	set_scanout.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
 	set_scanout.r.x = 0;
 	set_scanout.r.y = 0;
 	set_scanout.r.width = w;
@@ -694,17 +803,48 @@ static uint32_t setVirtioScanout(int idx, short rowbytes, short w, short h, uint
 	set_scanout.scanout_id = 0; // index, 0-15
 	set_scanout.resource_id = new_resource;
 
-	transact(&set_scanout, sizeof(set_scanout), &reply, sizeof(reply));
+	// All three in one round trip (only the last is fenced). If the host
+	// runs out of room for the resource, the other two fail harmlessly.
+	{
+		void *reqs[3] = {&create_2d, &attach_backing, &set_scanout};
+		size_t req_sizes[3] = {
+			sizeof(create_2d),
+			sizeof(attach_backing) - sizeof(attach_backing.entries) + extcnt*sizeof(attach_backing.entries[0]),
+			sizeof(set_scanout)};
+		void *reply_ptrs[3] = {&replies[0], &replies[1], &replies[2]};
+		size_t reply_sizes[3] = {sizeof(replies[0]), sizeof(replies[1]), sizeof(replies[2])};
+
+		transactChain(3, reqs, req_sizes, reply_ptrs, reply_sizes);
+	}
+
+	// Gracefully handle host running out of room for the resource
+	if (replies[0].type != VIRTIO_GPU_RESP_OK_NODATA) return 0;
+
+	if (replies[1].type != VIRTIO_GPU_RESP_OK_NODATA || replies[2].type != VIRTIO_GPU_RESP_OK_NODATA) {
+		// The host may already be showing the new resource: put back the old one
+		// (or none) before the new one goes away
+		if (replies[2].type == VIRTIO_GPU_RESP_OK_NODATA) {
+			set_scanout.r = res_rects[idx];
+			set_scanout.resource_id = old_resource;
+			transact(&set_scanout, sizeof(set_scanout), &reply, sizeof(reply));
+		}
+
+		resource_unref.hdr.type = VIRTIO_GPU_CMD_RESOURCE_UNREF;
+		resource_unref.resource_id = new_resource;
+		transact(&resource_unref, sizeof(resource_unref), &reply, sizeof(reply));
+		return 0;
+	}
 
+	// Only now is it safe to delete the old one (which also detaches its backing)
 	if (old_resource != 0) {
 		resource_unref.hdr.type = VIRTIO_GPU_CMD_RESOURCE_UNREF;
-		resource_unref.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
 		resource_unref.resource_id = old_resource;
 
 		transact(&resource_unref, sizeof(resource_unref), &reply, sizeof(reply));
 	}
 
 	res_ids[idx] = new_resource;
+	res_rects[idx] = set_scanout.r;
 	return new_resource;
 }
 
@@ -757,6 +897,12 @@ static void notificationAtomic(NMRecPtr nmReqPtr) {
 }
 
 void DNotified(uint16_t q, size_t len, void *tag) {
+	if (q == 1) {
+		freecursbufs |= 1 << (char)(uint32_t)tag;
+		sendCursor();
+		return;
+	}
+
 	last_tag = tag;
 	if ((unsigned long)tag < 256) {
 		freebufs |= 1 << (char)(uint32_t)tag;
@@ -789,22 +935,177 @@ void DirtyRectCallback(short top, short left, short bottom, short right) {
 
 	if (top >= bottom || left >= right) return;
 
-	updateScreen(top, left, bottom, right);
+	markTiles(top, left, bottom, right);
+}
+
+// Constant time per row of tiles, however many calls QuickDraw makes per frame.
+// Needn't be atomic: if flushDamage interrupts us, the worst that can happen
+// is that a tile it already took is marked again and sent again next time.
+static void markTiles(short t, short l, short b, short r) {
+	int x0 = l >> TILESHIFT, x1 = (r - 1) >> TILESHIFT;
+	int y0 = t >> TILESHIFT, y1 = (b - 1) >> TILESHIFT;
+	int w, y;
+
+	for (w=x0/32; w<=x1/32; w++) {
+		int lo = MAX(x0, w*32) - w*32, hi = MIN(x1, w*32+31) - w*32;
+		uint32_t mask = (0xffffffff >> lo) & (0xffffffff << (31 - hi));
+
+		for (y=y0; y<=y1; y++) {
+			dirtytiles[y][w] |= mask;
+		}
+	}
+}
+
+static void clearTiles(void) {
+	memset(dirtytiles, 0, sizeof dirtytiles);
+}
+
+// Interrupt time only (from VBL)
+// Each run of dirty tiles in a row becomes a rect, and addRect stacks
+// matching runs from the rows below into taller rects
+static void flushDamage(void) {
+	struct rects list = {0};
+	int rows = MIN((H + (1 << TILESHIFT) - 1) >> TILESHIFT, MAXTILES);
+	int words = MIN((((W + (1 << TILESHIFT) - 1) >> TILESHIFT) + 31) / 32, MAXTILES/32);
+	int i, x, y;
+
+	for (y=0; y<rows; y++) {
+		int start = -1;
+
+		for (x=0; x<words*32; x++) {
+			uint32_t word = dirtytiles[y][x/32];
+
+			if (start < 0 && word == 0) {
+				x += 31; // skip a clean word
+				continue;
+			}
+
+			if (word & (0x80000000 >> (x%32))) {
+				if (start < 0) start = x;
+				if (x%32 == 31) dirtytiles[y][x/32] = 0; // done with this word
+				continue;
+			}
+
+			if (start >= 0) {
+				addRect(&list, y << TILESHIFT, start << TILESHIFT, (y+1) << TILESHIFT, x << TILESHIFT);
+				start = -1;
+			}
+			if (x%32 == 31) dirtytiles[y][x/32] = 0;
+		}
+
+		if (start >= 0) {
+			addRect(&list, y << TILESHIFT, start << TILESHIFT, (y+1) << TILESHIFT, x << TILESHIFT);
+		}
+	}
+
+	if (change_in_progress) return;
+
+	for (i=0; i<list.n; i++) {
+		// Tiles overhang the right and bottom edges
+		list.r[i].b = MIN(list.r[i].b, H);
+		list.r[i].r = MIN(list.r[i].r, W);
+
+		blitRect(list.r[i].t, list.r[i].l, list.r[i].b, list.r[i].r);
+	}
+
+	ATOMIC1(sendRects, &list);
+}
+
+// Add a rect to a list of disjoint rects. Overlapping rects are merged, and so
+// are neighbours whose union is not much bigger than the two apart (a caret
+// and a clock stay separate, a run of characters becomes one rect).
+// When the list is full the cheapest merge is taken regardless.
+static void addRect(struct rects *list, short t, short l, short b, short r) {
+	if (t >= b || l >= r) return;
+
+	for (;;) {
+		long area = (long)(b - t) * (r - l);
+		long bestwaste = 0x7fffffff, bestsum = 0;
+		int i, best = -1;
+
+		for (i=0; i<list->n; i++) {
+			short et = list->r[i].t, el = list->r[i].l, eb = list->r[i].b, er = list->r[i].r;
+			long sum = area + (long)(eb - et) * (er - el);
+			long waste = (long)(MAX(b, eb) - MIN(t, et)) * (MAX(r, er) - MIN(l, el)) - sum;
+
+			if (et < b && t < eb && el < r && l < er) waste = -0x7fffffff; // overlap
+
+			if (waste < bestwaste) {
+				best = i;
+				bestwaste = waste;
+				bestsum = sum;
+			}
+		}
+
+		if (best < 0 || (bestwaste > bestsum/8 && list->n < MAXRECTS)) {
+			list->r[list->n].t = t;
+			list->r[list->n].l = l;
+			list->r[list->n].b = b;
+			list->r[list->n].r = r;
+			list->n++;
+			return;
+		}
+
+		// Merge, and go round again because the union might overlap another
+		t = MIN(t, list->r[best].t);
+		l = MIN(l, list->r[best].l);
+		b = MAX(b, list->r[best].b);
+		r = MAX(r, list->r[best].r);
+		list->r[best] = list->r[--list->n];
+	}
+}
+
+// When SetHardwareCursor has refused, QuickDraw draws its own cursor straight
+// into backbuf, not through our patches, so watch its low-memory state instead
+static void softCursorDamage(void) {
+	static Rect last;
+	static bool lastvis;
+
+	Rect now = *(Rect *)0x83c; // CrsrRect
+	bool vis = *(char *)0x8cc; // CrsrVis
+
+	if (vis == lastvis && (!vis || !memcmp(&now, &last, sizeof now))) return;
+
+	if (lastvis) DirtyRectCallback(last.top, last.left, last.bottom, last.right);
+	if (vis) DirtyRectCallback(now.top, now.left, now.bottom, now.right);
+
+	last = now;
+	lastvis = vis;
+}
+
+// Can the screen be refreshed from QuickDraw's damage alone? Not before our
+// patches are live (and never on 68k, which lacks them). Nor while the cursor
+// is hidden, because that is how programs bracket direct framebuffer writes.
+static bool damageTrusted(void) {
+	if (!curs_set) return qdworks && *(char *)0x8cc; // CrsrVis
+	return qdworks && curs_visible;
 }
 
 // Caller must not give out-of-range coords!
 static void updateScreen(short t, short l, short b, short r) {
+	if (change_in_progress) return;
+
+	blitRect(t, l, b, r);
+
+	ATOMIC2(sendPixels,
+		(((unsigned long)t << 16) | l),
+		(((unsigned long)b << 16) | r));
+}
+
+// Back buffer to front buffer, and the cursor on top
+static void blitRect(short t, short l, short b, short r) {
 	short drawn_l=l, drawn_r=r;
+	uint32_t *clut = depth == k16bit ? private_clut15 : private_clut;
 
-	if (change_in_progress) return;
+	if (zerocopy) return; // the host reads backbuf itself
 
 	Blit(depth - k1bit,
 		t, &drawn_l, b, &drawn_r,
 		backbuf, frontbuf, rowbytes_back,
-		private_clut, gamma_red, gamma_grn, gamma_blu);
+		clut, gamma_red, gamma_grn, gamma_blu);
 
 	// Any overlap with the cursor? Redraw the cursor.
-	if (curs_visible && curs_l < drawn_r && drawn_l < curs_r && curs_t < b && t < curs_b) {
+	if (curs_visible && !curs_hw && curs_l < drawn_r && drawn_l < curs_r && curs_t < b && t < curs_b) {
 		// Does the cursor need a clean background to draw on?
 		// And is the background overlap incomplete?
 		if (curs_inverts && (curs_l < drawn_l || drawn_r < curs_r || curs_t < t || b < curs_b)) {
@@ -812,15 +1113,22 @@ static void updateScreen(short t, short l, short b, short r) {
 			Blit(depth - k1bit,
 				curs_t, &my_curs_l, curs_b, &my_curs_r,
 				backbuf, frontbuf, rowbytes_back,
-				private_clut, gamma_red, gamma_grn, gamma_blu);
+				clut, gamma_red, gamma_grn, gamma_blu);
 		}
 
 		blitCursor();
 	}
+}
 
-	ATOMIC2(sendPixels,
-		(((unsigned long)t << 16) | l),
-		(((unsigned long)b << 16) | r));
+// Must be called atomically
+static void sendRects(struct rects *list) {
+	int i;
+
+	for (i=0; i<list->n; i++) {
+		addRect(&unsent, list->r[i].t, list->r[i].l, list->r[i].b, list->r[i].r);
+	}
+
+	sendPixels(0x7fff7fff, 0x00000000);
 }
 
 // Non-reentrant, must be called atomically
@@ -830,17 +1138,7 @@ static void sendPixels(uint32_t topleft, uint32_t botright) {
 	static bool reentered;
 	static bool interest;
 
-	// Stored pending rect
-	static short ptop = 0x7fff;
-	static short pleft = 0x7fff;
-	static short pbottom = 0;
-	static short pright = 0;
-
-	short top = topleft >> 16;
-	short left = topleft;
-	short bottom = botright >> 16;
-	short right = botright;
-
+	bool sent = false;
 	int i;
 
 	struct virtio_gpu_transfer_to_host_2d *obuf1; // 56 bytes
@@ -854,12 +1152,9 @@ static void sendPixels(uint32_t topleft, uint32_t botright) {
 	// We have been reentered via QPoll and DNotified -- nothing to do
 	if (reentered) return;
 
-	// Union the pending rect and the passed-in rect
-	top = MIN(top, ptop);
-	left = MIN(left, pleft);
-	bottom = MAX(bottom, pbottom);
-	right = MAX(right, pright);
-	if (top >= bottom || left >= right) return;
+	// Add the passed-in rect to the ones not yet sent
+	addRect(&unsent, topleft >> 16, topleft, botright >> 16, botright);
+	if (unsent.n == 0) return;
 
 	// Enable queue notifications so that none are missed after QPoll
 	if (!interest) {
@@ -874,65 +1169,64 @@ static void sendPixels(uint32_t topleft, uint32_t botright) {
 
 	// Now we are guaranteed that a free buffer won't be missed (unless we turn off rupts)
 
-	// No free buffer yet... return and wait for a queue notification
-	if (!freebufs) {
-		ptop = top;
-		pleft = left;
-		pbottom = bottom;
-		pright = right;
-		return;
-	}
-
-	// We have a free buffer, so don't need to wait for a notification to provide one
-	interest = false;
-	QInterest(0, -1);
-
-	// Pick a buffer
-	for (i=0; i<maxinflight; i++) {
-		if (freebufs & (1 << i)) {
-			freebufs &= ~(1 << i);
-			break;
+	// One buffer per rect, as many as are free (the rest wait for a notification)
+	while (unsent.n && freebufs) {
+		short top = unsent.r[unsent.n-1].t;
+		short left = unsent.r[unsent.n-1].l;
+		short bottom = unsent.r[unsent.n-1].b;
+		short right = unsent.r[unsent.n-1].r;
+		unsent.n--;
+
+		// Pick a buffer
+		for (i=0; i<maxinflight; i++) {
+			if (freebufs & (1 << i)) {
+				freebufs &= ~(1 << i);
+				break;
+			}
 		}
+
+		// The 4096-byte page is divided into 192-byte blocks for locality
+		obuf1 = (void *)((char *)lpage + 192*i);
+		obuf2 = (void *)((char *)obuf1 + 64);
+
+		physicals1[0] = ppage + 192*i;
+		physicals1[1] = physicals1[0] + 128;
+		physicals2[0] = physicals1[0] + 64;
+		physicals2[1] = physicals1[0] + 160;
+
+		// Update the host resource from guest memory.
+		obuf1->hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
+		obuf1->hdr.flags = 0;
+		obuf1->r.x = left;
+		obuf1->r.y = top;
+		obuf1->r.width = right - left;
+		obuf1->r.height = bottom - top;
+		obuf1->offset = top*rowbytes_front + left*4;
+		obuf1->offset_hi = 0;
+		obuf1->resource_id = screen_resource;
+
+		QSend(0, 1, 1, physicals1, sizes1, (void *)'tfer');
+
+		// Flush the updated resource to the display.
+		obuf2->hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
+		obuf2->hdr.flags = 0;
+		obuf2->r.x = left;
+		obuf2->r.y = top;
+		obuf2->r.width = right - left;
+		obuf2->r.height = bottom - top;
+		obuf2->resource_id = screen_resource;
+
+		QSend(0, 1, 1, physicals2, sizes2, (void *)i);
+		sent = true;
 	}
 
-	// The 4096-byte page is divided into 192-byte blocks for locality
-	obuf1 = (void *)((char *)lpage + 192*i);
-	obuf2 = (void *)((char *)obuf1 + 64);
-
-	physicals1[0] = ppage + 192*i;
-	physicals1[1] = physicals1[0] + 128;
-	physicals2[0] = physicals1[0] + 64;
-	physicals2[1] = physicals1[0] + 160;
-
-	// Update the host resource from guest memory.
-	obuf1->hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
-	obuf1->hdr.flags = 0;
-	obuf1->r.x = left;
-	obuf1->r.y = top;
-	obuf1->r.width = right - left;
-	obuf1->r.height = bottom - top;
-	obuf1->offset = top*rowbytes_front + left*4;
-	obuf1->offset_hi = 0;
-	obuf1->resource_id = screen_resource;
-
-	QSend(0, 1, 1, physicals1, sizes1, (void *)'tfer');
-
-	// Flush the updated resource to the display.
-	obuf2->hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
-	obuf2->hdr.flags = 0;
-	obuf2->r.x = left;
-	obuf2->r.y = top;
-	obuf2->r.width = right - left;
-	obuf2->r.height = bottom - top;
-	obuf2->resource_id = screen_resource;
-
-	QSend(0, 1, 1, physicals2, sizes2, (void *)i);
-	QNotify(0);
+	if (sent) QNotify(0);
 
-	ptop = 0x7fff;
-	pleft = 0x7fff;
-	pbottom = 0;
-	pright = 0;
+	// Everything sent, so don't need to wait for a notification to provide a buffer
+	if (unsent.n == 0) {
+		interest = false;
+		QInterest(0, -1);
+	}
 }
 
 static void perfTest(void) {
@@ -948,7 +1242,8 @@ static void perfTest(void) {
 	}
 
 	long t=LMGetTicks();
-	long ctr1=0, ctr2=0;
+	long ctr1=0, ctr2=0, ctr3=0;
+	int altivec = BlitterAltivec;
 
 	// Warm up
 	t += 2;
@@ -980,7 +1275,48 @@ static void perfTest(void) {
 		ctr2++;
 	}
 
-	printf("%ld Hz with gamma correction, %ld Hz without\n", ctr1*2, ctr2*2);
+	// Zero-copy skips the blitter, so there is nothing more to compare
+	if (zerocopy) {
+		printf("%ld Hz zero-copy (no blit), %ld Hz without\n", ctr1*2, ctr2*2);
+		return;
+	}
+
+	// Measure the scalar blitter too, if the vector one was used above
+	if (altivec && depth >= k16bit) {
+		BlitterAltivec = 0;
+		t += 30;
+		while (t > LMGetTicks()) {
+			while (freebufs == 0) QPoll(0);
+			updateScreen(0, 0, H, W);
+			ctr3++;
+		}
+		BlitterAltivec = altivec;
+
+		printf("%ld Hz with gamma correction (AltiVec), %ld Hz (scalar), %ld Hz without\n",
+			ctr1*2, ctr3*2, ctr2*2);
+	} else {
+		printf("%ld Hz with gamma correction, %ld Hz without\n", ctr1*2, ctr2*2);
+	}
+
+	// The blitter alone, with nothing sent to the host to dilute the difference
+	if (depth >= k16bit) {
+		long hz[2] = {0, 0};
+		for (int v=0; v<=altivec; v++) {
+			BlitterAltivec = v;
+			t += 30;
+			while (t > LMGetTicks()) {
+				blitRect(0, 0, H, W);
+				hz[v] += 2;
+			}
+		}
+		BlitterAltivec = altivec;
+
+		if (altivec) {
+			printf("Blit only: %ld Hz scalar, %ld Hz AltiVec\n", hz[0], hz[1]);
+		} else {
+			printf("Blit only: %ld Hz scalar (no AltiVec)\n", hz[0]);
+		}
+	}
 }
 
 static OSStatus VBL(void *p1, void *p2) {
@@ -989,9 +1325,24 @@ static OSStatus VBL(void *p1, void *p2) {
 		VSLDoInterruptService(vblservice);
 	}
 
-	updateScreen(0, 0, H, W);
+	if (qdworks && !curs_set) softCursorDamage();
+
+	// Only send what changed, unless the damage might be incomplete
+	bool trusted = damageTrusted();
+	bool full = !qdworks ||
+		(trusted && !dmg_trusted) || // catch the end of any direct writes
+		(!trusted && ++dmg_untrusted_vbls >= SLOW_REFRESH);
 
-	vbltime = AddDurationToAbsolute(qdworks ? SLOW_REFRESH : FAST_REFRESH, vbltime);
+	if (full) {
+		dmg_untrusted_vbls = 0;
+		clearTiles();
+		updateScreen(0, 0, H, W);
+	} else {
+		flushDamage();
+	}
+	dmg_trusted = trusted;
+
+	vbltime = AddDurationToAbsolute(FAST_REFRESH, vbltime);
 	SetInterruptTimer(&vbltime, VBL, NULL, &vbltimer);
 
 	return noErr;
@@ -1106,6 +1457,7 @@ static void setGammaTable(GammaTbl *tbl) {
 	long size = 12 +
 		tbl->gFormulaSize +
 		(long)tbl->gChanCnt * tbl->gDataCnt * tbl->gDataWidth / 8;
+	bool changed = false;
 	int i, j;
 
 	memcpy(gamma_public, tbl, size);
@@ -1136,10 +1488,22 @@ static void setGammaTable(GammaTbl *tbl) {
 		// }
 
 		for (j=0; j<256 && j<tbl->gDataCnt; j++) {
+			if (dst[j] != src[j * tbl->gDataWidth / 8]) changed = true;
 			dst[j] = src[j * tbl->gDataWidth / 8];
 		}
 	}
 
+	// The Display Manager resends the same table often, and this is 32K entries
+	if (changed) BlitTable15(private_clut15, gamma_red, gamma_grn, gamma_blu);
+
+	gamma_identity = true;
+	for (j=0; j<256; j++) {
+		if (gamma_red[j] != j || gamma_grn[j] != j || gamma_blu[j] != j) {
+			gamma_identity = false;
+			break;
+		}
+	}
+
 	gammaCursor();
 }
 
@@ -1262,6 +1626,11 @@ static OSStatus SetGamma(VDGammaRecord *rec) {
 		// and is guaranteed to be followed by a SetEntries to fix the CLUT.
 		linearCLUT();
 	} else {
+		// Start or stop scanning out QuickDraw's buffer directly
+		if (depth == k32bit && zerocopyWanted(depth) != zerocopy) {
+			mode(depth, idForRes(W, H, false));
+		}
+
 		// What to do on direct devices?
 		updateScreen(0, 0, H, W);
 	}
@@ -1720,11 +2089,22 @@ static OSStatus SetHardwareCursor(VDSetHardwareCursorRec *rec) {
 		(void *)curs_back
 	};
 
+	short old_t = curs_t, old_l = curs_l, old_b = curs_b, old_r = curs_r;
+	bool was_composited = curs_visible && !curs_hw;
+	bool was_hw;
+
 	for (i=0; i<sizeof(curs_bmp_values)/sizeof(*curs_bmp_values); i++) {
 		curs_bmp_values[i] = i;
 	}
 
 	if (!VSLPrepareCursorForHardwareCursor(rec->csCursorRef, &curs_desc, &curs_struct)) {
+		// QuickDraw will draw this one, so hide the host's copy of the last
+		if (curs_hw) {
+			curs_hw = false;
+			curs_hw_stale = true;
+			curs_hw_pending = true;
+			ATOMIC(sendCursor);
+		}
 		curs_set = false;
 		return controlErr;
 	}
@@ -1775,7 +2155,37 @@ static OSStatus SetHardwareCursor(VDSetHardwareCursorRec *rec) {
 		}
 	}
 
-	gammaCursor();
+	// The host cursor plane has no inverting pixels
+	was_hw = curs_hw;
+	curs_hw = hostcursor && !curs_inverts;
+	if (curs_hw) {
+		curs_hw_stale = true;
+		curs_hot_stale = true;
+	} else if (was_hw) {
+		// Hide the host's copy, and composite from the next DrawHardwareCursor
+		curs_hw_stale = true;
+		curs_hw_pending = true;
+		ATOMIC(sendCursor);
+	}
+
+	// Zero-copy waited for this call (see zerocopyWanted)
+	if (!curs_hw) curs_set = false;
+	if (!zerocopy && zerocopyWanted(depth)) {
+		mode(depth, idForRes(W, H, false));
+	}
+
+	// QuickDraw must draw its own cursor into a buffer the host scans out
+	if (zerocopy && !curs_hw) {
+		curs_visible = false;
+		return controlErr;
+	}
+
+	gammaCursor(); // also uploads to the host plane
+
+	// Moving to the host plane, so take our copy off the screen
+	if (curs_hw && was_composited && old_t < H && old_l < W && old_b > 0 && old_r > 0) {
+		updateScreen(MAX(old_t, 0), MAX(old_l, 0), MIN(old_b, H), MIN(old_r, W));
+	}
 
 	curs_set = true;
 	return noErr;
@@ -1794,6 +2204,35 @@ static OSStatus DrawHardwareCursor(VDDrawHardwareCursorRec *rec) {
 
 	if (!curs_set) return controlErr;
 
+	// One small command, and the framebuffer is never touched
+	if (curs_hw) {
+		if (curs_visible != rec->csCursorVisible) curs_hw_stale = true;
+
+		curs_visible = rec->csCursorVisible;
+		curs_b += rec->csCursorY - curs_t;
+		curs_r += rec->csCursorX - curs_l;
+		curs_t = rec->csCursorY;
+		curs_l = rec->csCursorX;
+
+		// The host lines the hotspot up with its own pointer, but we are only
+		// told the top left, so work it out from where the mouse is now
+		if (curs_hot_stale && curs_visible) {
+			Point mouse = *(Point *)0x830; // Mouse
+			short x = mouse.h - curs_l, y = mouse.v - curs_t;
+
+			if (x < 0 || x >= CURSOREDGE || y < 0 || y >= CURSOREDGE) x = y = 0;
+
+			if (x != curs_hot_x || y != curs_hot_y) curs_hw_stale = true;
+			curs_hot_x = x;
+			curs_hot_y = y;
+			curs_hot_stale = false;
+		}
+
+		curs_hw_pending = true;
+		ATOMIC(sendCursor);
+		return noErr;
+	}
+
 	// Erase the old one
 	if (curs_visible) {
 		t = MIN(t, curs_t);
@@ -1840,6 +2279,17 @@ static void gammaCursor(void) {
 
 		curs_front[i] = pixel;
 	}
+
+	// A cursor on the host plane must have its pixels there
+	// (a new cursor is sent by DrawHardwareCursor, once it knows the hotspot)
+	if (curs_hw) {
+		ATOMIC(uploadCursor);
+		curs_hw_stale = true;
+		if (!curs_hot_stale) {
+			curs_hw_pending = true;
+			ATOMIC(sendCursor);
+		}
+	}
 }
 
 // Copy cursor to front buffer
@@ -1862,3 +2312,117 @@ static void blitCursor(void) {
 		}
 	}
 }
+
+// Create the 64x64 host cursor resource, backed by our own pages
+static bool initHostCursor(void) {
+	struct virtio_gpu_resource_create_2d create_2d = {0};
+	struct virtio_gpu_resource_attach_backing attach_backing = {0};
+	struct virtio_gpu_ctrl_hdr reply;
+	int i;
+
+	cursbuf = AllocPages(sizeof(cursbufpages)/sizeof(*cursbufpages), cursbufpages);
+	if (cursbuf == NULL) return false;
+
+	create_2d.hdr.type = VIRTIO_GPU_CMD_RESOURCE_CREATE_2D;
+	create_2d.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
+	create_2d.resource_id = cursor_resource;
+	create_2d.format = VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM;
+	create_2d.width = HOSTCURSOREDGE;
+	create_2d.height = HOSTCURSOREDGE;
+
+	transact(&create_2d, sizeof(create_2d), &reply, sizeof(reply));
+	if (reply.type != VIRTIO_GPU_RESP_OK_NODATA) return false;
+
+	attach_backing.hdr.type = VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING;
+	attach_backing.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
+	attach_backing.resource_id = cursor_resource;
+	attach_backing.nr_entries = sizeof(cursbufpages)/sizeof(*cursbufpages);
+
+	for (i=0; i<attach_backing.nr_entries; i++) {
+		attach_backing.entries[i].addr = cursbufpages[i];
+		attach_backing.entries[i].length = 0x1000;
+	}
+
+	transact(&attach_backing, sizeof(attach_backing), &reply, sizeof(reply));
+	return reply.type == VIRTIO_GPU_RESP_OK_NODATA;
+}
+
+// Must be called atomically
+// Copy curs_front into the host cursor resource, as BGRA
+static void uploadCursor(void) {
+	struct virtio_gpu_transfer_to_host_2d transfer = {0};
+	struct virtio_gpu_ctrl_hdr reply;
+	short x, y;
+
+	for (y=0; y<CURSOREDGE; y++) {
+		for (x=0; x<CURSOREDGE; x++) {
+			uint32_t pixel = curs_front[CURSOREDGE*y + x];
+			((uint32_t *)cursbuf)[HOSTCURSOREDGE*y + x] = (pixel & 0x80) ? 0 : (pixel | 0xff);
+		}
+	}
+
+	transfer.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
+	transfer.hdr.flags = VIRTIO_GPU_FLAG_FENCE;
+	transfer.r.width = CURSOREDGE;
+	transfer.r.height = CURSOREDGE;
+	transfer.resource_id = cursor_resource;
+
+	transact(&transfer, sizeof(transfer), &reply, sizeof(reply));
+}
+
+// Non-reentrant, must be called atomically
+// Sends the latest cursor state, or leaves it for DNotified to send
+static void sendCursor(void) {
+	static bool reentered;
+	static bool interest;
+
+	struct virtio_gpu_update_cursor *obuf;
+	uint32_t physical;
+	uint32_t size = sizeof(*obuf);
+	int i;
+
+	if (reentered || !curs_hw_pending) return;
+
+	// As in sendPixels, so that no freed buffer is missed
+	if (!interest) {
+		interest = true;
+		QInterest(1, 1);
+	}
+
+	reentered = true;
+	QPoll(1);
+	reentered = false;
+
+	if (freecursbufs) {
+		for (i=0; i<16; i++) {
+			if (freecursbufs & (1 << i)) {
+				freecursbufs &= ~(1 << i);
+				break;
+			}
+		}
+
+		obuf = (void *)((char *)lpage + 4096 - 16*CURSORSLOT + CURSORSLOT*i);
+		physical = ppage + 4096 - 16*CURSORSLOT + CURSORSLOT*i;
+
+		// Only an UPDATE changes the image, hotspot or visibility
+		memset(obuf, 0, sizeof(*obuf));
+		obuf->hdr.type = curs_hw_stale ? VIRTIO_GPU_CMD_UPDATE_CURSOR : VIRTIO_GPU_CMD_MOVE_CURSOR;
+		obuf->pos.scanout_id = 0;
+		obuf->pos.x = MAX(curs_l + curs_hot_x, 0);
+		obuf->pos.y = MAX(curs_t + curs_hot_y, 0);
+		obuf->resource_id = (curs_hw && curs_visible) ? cursor_resource : 0; // 0 hides
+		obuf->hot_x = curs_hot_x;
+		obuf->hot_y = curs_hot_y;
+
+		QSend(1, 1, 0, &physical, &size, (void *)i);
+		QNotify(1);
+
+		curs_hw_stale = false;
+		curs_hw_pending = false;
+	}
+
+	if (!curs_hw_pending) {
+		interest = false;
+		QInterest(1, -1);
+	}
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+
+# Decode the binary fsCall trace from device-9p.c
+#
+# Get a trace with DriverConfigure 'trce' (see dcTrace): either the .fstrace
+# file appended to at the root of the share, or "Trace: <hex>" lines in a log.
+#
+#   fstrace.py dump TRACE            one line per call
+#   fstrace.py summary TRACE         per-selector counts, latency, round trips
+#
+# To replay a trace through 9p.c and the in-process server, measuring time and
+# round trips per call, see host/replay9p.
+
+import collections
+import struct
+import sys
+
+REC = struct.Struct('>HhIIiiIIIHhh26p')
+
+NAMES = {
+	0xa000: 'HOpen', 0xa001: 'Close', 0xa002: 'Read', 0xa003: 'Write',
+	0xa007: 'HGetVolInfo', 0xa008: 'HCreate', 0xa009: 'HDelete', 0xa00a: 'HOpenRF',
+	0xa00b: 'HRename', 0xa00c: 'HGetFileInfo', 0xa00d: 'HSetFileInfo',
+	0xa00e: 'UnmountVol', 0xa00f: 'MountVol', 0xa010: 'Allocate', 0xa011: 'GetEOF',
+	0xa012: 'SetEOF', 0xa013: 'FlushVol', 0xa014: 'HGetVol', 0xa015: 'HSetVol',
+	0xa017: 'Eject', 0xa018: 'GetFPos', 0xa035: 'Offline', 0xa041: 'SetFilLock',
+	0xa042: 'RstFilLock', 0xa043: 'SetFilType', 0xa044: 'SetFPos', 0xa045: 'FlushFile',
+	0x0001: 'OpenWD', 0x0002: 'CloseWD', 0x0005: 'CatMove', 0x0006: 'DirCreate',
+	0x0007: 'GetWDInfo', 0x0008: 'GetFCBInfo', 0x0009: 'GetCatInfo',
+	0x000a: 'SetCatInfo', 0x000b: 'SetVolInfo', 0x0012: 'XGetVolInfo',
+	0x0018: 'CatSearch', 0x001a: 'OpenDF', 0x001b: 'MakeFSSpec', 0x0030: 'GetVolParms',
+}
+
+REFNUMCALLS = {0xa001, 0xa002, 0xa003, 0xa010, 0xa011, 0xa012, 0xa018, 0xa044, 0xa045}
+
+Rec = collections.namedtuple('Rec', 'selector result start duration dirid outdirid '
+	'count actual position roundtrips vrefnum refnum name')
+
+def load(path):
+	data = open(path, 'rb').read()
+	if b'Trace: ' in data:
+		data = b''.join(bytes.fromhex(l.split(b'Trace: ')[1].decode().strip())
+			for l in data.splitlines()
+			if b'Trace: ' in l and b'flushed' not in l and b'cannot' not in l)
+
+	for i in range(0, len(data) - REC.size + 1, REC.size):
+		r = Rec(*REC.unpack_from(data, i))
+		yield r._replace(name=r.name.decode('mac_roman'))
+
+def name(sel):
+	return NAMES.get(sel, f'{sel:04x}')
+
+def dump(recs):
+	for r in recs:
+		if r.selector in REFNUMCALLS:
+			args = f'ref={r.refnum} count={r.count} actual={r.actual} pos={r.position}'
+		else:
+			args = f'vol={r.vrefnum} dir={r.dirid} name={r.name!r} -> dir={r.outdirid}'
+		print(f'{r.start:10d} {name(r.selector):14s} {args}  err={r.result} {r.duration}us {r.roundtrips}rt')
+
+def summary(recs):
+	stats = collections.defaultdict(lambda: [0, 0, 0, 0])
+	for r in recs:
+		s = stats[r.selector]
+		s[0] += 1
+		s[1] += r.duration
+		s[2] = max(s[2], r.duration)
+		s[3] += r.roundtrips
+
+	grand = sum(s[1] for s in stats.values()) or 1
+	print(f'{"call":14s} {"count":>7s} {"total-us":>10s} {"%":>4s} {"mean-us":>8s} {"worst-us":>8s} {"rt/call":>7s}')
+	for sel, (n, total, worst, rt) in sorted(stats.items(), key=lambda kv: -kv[1][1]):
+		print(f'{name(sel):14s} {n:7d} {total:10d} {100*total//grand:4d} {total//n:8d} {worst:8d} {rt/n:7.2f}')
+
+if __name__ == '__main__':
+	cmd, trace = sys.argv[1:3]
+	recs = list(load(trace))
+	if cmd == 'dump':
+		dump(recs)
+	elif cmd == 'summary':
+		summary(recs)
+	else:
+		sys.exit(f'unknown command {cmd}')
@@ -5,22 +5,79 @@ File Mgr calls are not allowed to move memory (i.e. call the Memory Mgr at all,
 or access an unlocked block). The only exceptions are synchronous MountVol,
 Open and OpenWD calls. So the HTallocate() call can be made at those times.
 
-TODO:
-Reclaim stale data in the array (e.g. free list inside the heap block)
+Out-of-line keys and values live in a "store", a locked handle that is
+bump-allocated. Freed chunks go on free lists by size, and when more than half
+of the store is free, a fresh store is allocated at system task time and the
+live data is copied across a few table slots at a time (semispace style).
+Each entry has a flag to say which of the two stores its data is in.
+
+The table itself grows the same way, so there is never a long pause. A spare
+table twice the size is allocated ahead of time, at system task time. When the
+table reaches half full (even in the middle of a File Mgr call), the spare is
+swapped in and the old table is drained into it a few slots per install or
+delete. Lookups check both tables until the old one is empty, and it is freed
+at the next safe opportunity.
+
+Also builds on the host, for testing and benchmarking (with the CNID database):
+	cc -DHTHOST -O2 -o hashtab hashtab.c cniddb.c && ./hashtab
 */
 
+#ifdef HTHOST
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#else
 #include <LowMem.h>
 #include <Memory.h>
+#endif
 
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdalign.h>
 
 #include "hashtab.h"
-
+#ifdef HTHOST
+#include "cniddb.h"
+#endif
+
+#ifdef HTHOST
+// Just enough Memory Mgr and Notification Mgr to run the harness
+typedef char *Ptr;
+typedef Ptr *Handle;
+typedef struct NMRec {short qType; void *nmResp;} NMRec, *NMRecPtr;
+struct hosthandle {Ptr p; size_t size;};
+static Ptr NewPtrSysClear(size_t size) {return calloc(1, size);}
+static void DisposePtr(Ptr p) {free(p);}
+static Handle NewHandleSysClear(size_t size) {
+	struct hosthandle *h = malloc(sizeof *h);
+	*h = (struct hosthandle){calloc(1, size), size};
+	return &h->p;
+}
+static void DisposeHandle(Handle h) {free(*h); free(h);}
+static size_t GetHandleSize(Handle h) {return ((struct hosthandle *)h)->size;}
+static void SetHandleSize(Handle h, size_t size) {
+	struct hosthandle *hh = (void *)h;
+	hh->p = realloc(hh->p, size);
+	if (size > hh->size) memset(hh->p + hh->size, 0, size - hh->size);
+	hh->size = size;
+}
+static void HLock(Handle h) {}
+static void HUnlock(Handle h) {}
+static short LMGetMemErr(void) {return 0;}
+static void LMSetMemErr(short err) {}
+static void NMInstall(NMRecPtr rec) {}
+static void NMRemove(NMRecPtr rec) {}
+#define STATICDESCRIPTOR(func, info) (func)
+#define panic(msg) (fprintf(stderr, "%s\n", msg), abort())
+static size_t lookups; // counted for the benchmarks
+#else
 #include "callupp.h"
 #include "printf.h"
 #include "panic.h"
+#endif
+
+#include <stdbool.h> // leave till last, conflicts with Universal Interfaces
 
 // Keep to 16 bytes
 struct entry {
@@ -34,25 +91,73 @@ struct entry {
 	} val;
 	short klen;
 	short vlen;
-	int tag;
+	char tag;
+	unsigned char flags;
+	unsigned short fingerprint; // top of the hash, to skip most mismatches cheaply
+};
+
+enum {
+	INNEWSTORE = 1, // data has been copied to the new store by the compactor
+	MOVED = 2, // old table only: entry now lives in the new table (or deleted)
+};
+
+// Free chunk sizes are multiples of 8, so class n holds chunks of 8n bytes
+// Chunks too big for a class go on one list, and need an exact size match
+enum {
+	NCLASS = 66, // enough for a '$' record with a 511-byte name
+	COMPACTSTEP = 1024, // slots examined per system task visit
+	MINCOMPACT = 32*1024, // don't bother compacting a small store
+	MIGRATESTEP = 8, // old table slots drained per install or delete
+	MIGRATESYSTASK = 4096, // old table slots drained per system task visit
+};
+
+struct freechunk {
+	uint32_t next; // offset of next free chunk, 0 = end of list
+	uint32_t size;
+};
+
+struct store {
+	Handle h;
+	size_t size, used, freed;
+	uint32_t freelist[NCLASS];
+	uint32_t bigfree;
 };
 
 // Linearly probed hash table
 // Grow exponentially to keep occupancy between 25% and 50%
 static struct entry *table;
-static size_t tablesize, tableused;
+static size_t tablesize, tableused; // tableused counts live entries in both tables
+
+static struct entry *oldtable; // draining into table, only while growing
+static size_t oldtablesize, migrateCursor;
+static struct entry *sparetable; // the next table, allocated ahead of time
+static size_t sparetablesize;
+static struct entry *deadtable; // fully drained, free when it's safe
 
-static Handle blob;
-static size_t blobsize, blobused;
+// Offset zero is never handed out, so that it can mean "none" in a free list
+static struct store blob = {.used = 8};
+static struct store newblob; // only while compacting
+static size_t compactCursor;
 
 static int notificationPending;
 
 static size_t chooseTableSize(void);
-static size_t chooseBlobSize(void);
+static bool tableWantsMemory(void);
+static void switchTable(void);
+static void migrate(size_t slots);
+static size_t chooseStoreSize(size_t used);
+static struct store *target(void);
+static bool growStore(struct store *s, size_t used);
+static void compactStart(void);
+static void compactStep(void);
+static bool compactWanted(void);
 static void notificationProc(NMRecPtr nmReqPtr);
-static unsigned long hash(int tag, const void *key, short klen);
-static size_t store(const void *data, size_t bytes);
+static uint32_t hash(int tag, const void *key, short klen);
+static size_t store(struct store *s, const void *data, size_t bytes);
+static void unstore(struct entry *e, size_t offset, size_t bytes);
+static struct entry *probe(struct entry *t, size_t size, uint32_t h, int tag, const void *key, short klen);
 static struct entry *find(int tag, const void *key, short klen);
+static char *entrystore(struct entry *e);
 static void *entrykey(struct entry *e);
 static void *entryval(struct entry *e);
 static void dump(void);
@@ -62,42 +167,61 @@ static void dump(void);
 void HTallocate(void) {
 	short saveMemErr = LMGetMemErr();
 
-	size_t newtablesize = chooseTableSize();
-
-	if (newtablesize > tablesize) {
-		struct entry *newtable = (void *)NewPtrSysClear(newtablesize * sizeof (struct entry));
-		if (newtable != NULL) {
-			// Copy entries across
-			for (size_t i=0; i<tablesize; i++) {
-				struct entry *e = &table[i];
-				unsigned long probe = hash(e->tag, entrykey(e), e->klen);
-				while (newtable[probe & (newtablesize - 1)].klen != 0) probe++;
-				newtable[probe & (newtablesize - 1)] = *e;
-			}
+	migrate(MIGRATESYSTASK);
 
-			if (table) DisposePtr((void *)table);
-			table = newtable;
-			tablesize = newtablesize;
-			printf("Hash table slots: %d\n", tablesize);
-		}
+	if (deadtable) {
+		DisposePtr((void *)deadtable);
+		deadtable = NULL;
 	}
 
-	size_t newblobsize = chooseBlobSize();
+	if (table == NULL) {
+		size_t size = chooseTableSize();
+		table = (void *)NewPtrSysClear(size * sizeof (struct entry));
+		if (table) tablesize = size;
+		printf("Hash table slots: %d\n", tablesize);
+	} else if (sparetable == NULL && oldtable == NULL && tableused >= tablesize*3/8) {
+		// Getting on for half full, so have the next table ready
+		size_t size = chooseTableSize();
+		if (size < tablesize*2) size = tablesize*2;
+		sparetable = (void *)NewPtrSysClear(size * sizeof (struct entry));
+		if (sparetable) sparetablesize = size;
+	}
 
-	if (newblobsize > blobsize) {
-		if (blob == NULL) {
-			blob = NewHandleClear(newblobsize);
-			if (blob) HLock(blob);
-			blobsize = blob ? newblobsize : 0;
-		} else {
-			HUnlock(blob);
-			SetHandleSize(blob, newblobsize);
-			blobsize = GetHandleSize(blob);
-			HLock(blob);
+	if (sparetable && tableused >= tablesize/2) switchTable();
+
+	growStore(target(), target()->used);
+
+	LMSetMemErr(saveMemErr);
+}
+
+// Make room for this many more entries and store bytes in one go, so that a
+// table expected to get big doesn't double over and over while it fills
+// Calls the Memory Manager -- only when moving memory is safe
+void HTreserve(size_t entries, size_t bytes) {
+	short saveMemErr = LMGetMemErr();
+
+	if (deadtable) {
+		DisposePtr((void *)deadtable);
+		deadtable = NULL;
+	}
+
+	// Stay under the point where a spare table would be wanted
+	size_t want = tableused + entries;
+	size_t size = 4096;
+	while (size*3/8 <= want) size *= 2;
+
+	if (size > tablesize && oldtable == NULL) {
+		struct entry *t = (void *)NewPtrSysClear(size * sizeof (struct entry));
+		if (t) {
+			if (sparetable) DisposePtr((void *)sparetable);
+			sparetable = t;
+			sparetablesize = size;
+			switchTable(); // any existing entries drain across as usual
 		}
-		printf("Hash table storage bytes: %d\n", blobsize);
 	}
 
+	growStore(target(), target()->used + bytes);
+
 	LMSetMemErr(saveMemErr);
 }
 
@@ -107,18 +231,94 @@ static size_t chooseTableSize(void) {
 	return s;
 }
 
-static size_t chooseBlobSize(void) {
+// Needs a spare allocated, or an old table drained or freed
+static bool tableWantsMemory(void) {
+	return table == NULL || oldtable != NULL || deadtable != NULL ||
+		(sparetable == NULL && tableused >= tablesize*3/8);
+}
+
+// Swap in the spare table and start draining the current one into it
+// Doesn't call the Memory Manager, so safe to do at any time
+static void switchTable(void) {
+	oldtable = table;
+	oldtablesize = tablesize;
+	migrateCursor = 0;
+
+	table = sparetable;
+	tablesize = sparetablesize;
+	sparetable = NULL;
+	sparetablesize = 0;
+
+	compactCursor = 0; // entries moving, so rescan (the flags say what's done)
+	printf("Hash table slots: %d\n", tablesize);
+}
+
+// Move a bounded number of old table slots into the new table
+static void migrate(size_t slots) {
+	if (oldtable == NULL) return;
+
+	size_t limit = migrateCursor + slots;
+	if (limit > oldtablesize) limit = oldtablesize;
+
+	for (; migrateCursor<limit; migrateCursor++) {
+		struct entry *e = &oldtable[migrateCursor];
+		if (e->klen == 0 || (e->flags & MOVED)) continue;
+
+		void *key = entrykey(e);
+		struct entry *slot = probe(table, tablesize, hash(e->tag, key, e->klen), e->tag, key, e->klen);
+		if (!slot) panic("Hash table out of slots!");
+		*slot = *e;
+		e->flags |= MOVED;
+	}
+
+	if (migrateCursor < oldtablesize) return;
+
+	// Drained, but wait for a safe time to free it
+	deadtable = oldtable;
+	oldtable = NULL;
+	oldtablesize = 0;
+	compactCursor = 0; // some entries may have landed behind the compactor
+}
+
+static size_t chooseStoreSize(size_t used) {
 	size_t s = 64*1024;
-	while (s/2 <= blobused) s *= 2;
+	while (s/2 <= used) s *= 2;
 	return s;
 }
 
+// New data goes in the new store while compacting
+static struct store *target(void) {
+	return newblob.h ? &newblob : &blob;
+}
+
+// Calls the Memory Manager
+static bool growStore(struct store *s, size_t used) {
+	size_t newsize = chooseStoreSize(used);
+	if (newsize <= s->size) return true;
+
+	if (s->h == NULL) {
+		s->h = NewHandleSysClear(newsize);
+		if (s->h) HLock(s->h);
+		s->size = s->h ? newsize : 0;
+	} else {
+		HUnlock(s->h);
+		SetHandleSize(s->h, newsize);
+		s->size = GetHandleSize(s->h);
+		HLock(s->h);
+	}
+	printf("Hash table storage bytes: %d\n", s->size);
+
+	return s->size >= newsize;
+}
+
 void HTallocatelater(void) {
 	// If CurApName has a negative length byte, system is still booting, don't use
 	if (*(char *)0x910 < 0) return;
 
 	if (notificationPending) return;
-	if (chooseTableSize() <= tablesize || chooseBlobSize() <= blobsize) return;
+	if (!tableWantsMemory() &&
+		chooseStoreSize(target()->used) <= target()->size &&
+		!compactWanted() && newblob.h == NULL) return;
 
 	printf("Hash table needs memory: posting notification task\n");
 
@@ -135,31 +335,122 @@ static void notificationProc(NMRecPtr nmReqPtr) {
 	notificationPending = 0;
 
 	HTallocate(); // call Memory Manager
-	HTallocatelater(); // reschedule in case there was a failure
+	if (compactWanted()) compactStart(); // also calls Memory Manager
+	if (newblob.h) compactStep();
+	HTallocatelater(); // reschedule in case there was a failure, or more to do
+}
+
+// More than half the store is holes
+static bool compactWanted(void) {
+	return newblob.h == NULL && blob.used >= MINCOMPACT && blob.freed > blob.used/2;
+}
+
+// Calls the Memory Manager
+static void compactStart(void) {
+	short saveMemErr = LMGetMemErr();
+
+	// Room for the live data, with the usual headroom
+	size_t size = chooseStoreSize(blob.used - blob.freed);
+	Handle h = NewHandleSysClear(size);
+	if (h) {
+		HLock(h);
+		newblob = (struct store){.h = h, .size = size, .used = 8};
+		compactCursor = 0;
+		printf("Hash table compacting %d of %d bytes\n", blob.used - blob.freed, blob.used);
+	}
+
+	LMSetMemErr(saveMemErr);
+}
+
+// Copy one entry's data into the new store
+static void compactEntry(struct entry *e) {
+	if (e->klen == 0 || (e->flags & INNEWSTORE)) return;
+
+	if (e->klen > 4) e->key.offset = store(&newblob, *blob.h + e->key.offset, e->klen);
+	if (e->vlen > 4) e->val.offset = store(&newblob, *blob.h + e->val.offset, e->vlen);
+	e->flags |= INNEWSTORE;
+}
+
+// Copy a bounded number of entries into the new store
+// Calls the Memory Manager when finished
+static void compactStep(void) {
+	size_t limit = compactCursor + COMPACTSTEP;
+	if (limit > tablesize) limit = tablesize;
+
+	for (; compactCursor<limit; compactCursor++) {
+		compactEntry(&table[compactCursor]);
+	}
+
+	// Entries still in the old table haven't been copied yet
+	if (compactCursor < tablesize || oldtable) return;
+
+	// Every entry is in the new store, so drop the old one
+	for (size_t i=0; i<tablesize; i++) {
+		if (table[i].klen != 0 && !(table[i].flags & INNEWSTORE)) {
+			panic("Hash table compactor missed an entry!");
+		}
+		table[i].flags &= ~INNEWSTORE;
+	}
+	DisposeHandle(blob.h);
+	blob = newblob;
+	newblob = (struct store){};
+	printf("Hash table compacted to %d bytes\n", blob.used);
 }
 
 void HTinstall(int tag, const void *key, short klen, const void *val, short vlen) {
-	struct entry *found = find(tag, key, klen);
+	migrate(MIGRATESTEP);
+
+	uint32_t h = hash(tag, key, klen);
+
+	// Bring an existing entry across first, so there is only one copy of the key
+	if (oldtable) {
+		struct entry *old = probe(oldtable, oldtablesize, h, tag, key, klen);
+		if (old && old->klen != 0) {
+			struct entry *slot = probe(table, tablesize, h, tag, key, klen);
+			if (!slot) panic("Hash table out of slots!");
+			*slot = *old;
+			old->flags |= MOVED;
+		}
+	}
+
+	struct entry *found = probe(table, tablesize, h, tag, key, klen);
+
+	// About to pass half full: use the spare if we have one
+	if (found && found->klen == 0 && sparetable && tableused+1 >= tablesize/2) {
+		switchTable();
+		found = probe(table, tablesize, h, tag, key, klen);
+	}
 
 	if (!found) {
 		panic("Hash table out of slots!");
 	} else if (found->klen != 0) {
 		// Overwrite existing table entry
+		bool wasinline = found->vlen <= 4;
+		bool sameroom = !wasinline && ((vlen + 7) & -8) == ((found->vlen + 7) & -8);
+
 		if (vlen <= 4) {
 			// Inline
+			if (!wasinline) unstore(found, found->val.offset, found->vlen);
 			memcpy(found->val.inln, val, vlen);
-		} else if (vlen <= ((found->vlen + 7) & -8)) {
-			// Out of line but shorter
-			memcpy(*blob + found->val.offset, val, vlen);
+		} else if (sameroom) {
+			// Out of line and the same size chunk
+			memcpy(entrystore(found) + found->val.offset, val, vlen);
 		} else {
-			// Allocate room for new value
-			found->val.offset = store(val, vlen);
+			// Allocate room for new value, and the key too if it must move
+			if (!wasinline) unstore(found, found->val.offset, found->vlen);
+			if (newblob.h && !(found->flags & INNEWSTORE)) {
+				if (klen > 4) found->key.offset = store(&newblob, *blob.h + found->key.offset, klen);
+				found->flags |= INNEWSTORE;
+			}
+			found->val.offset = store(target(), val, vlen);
 		}
 		found->vlen = vlen;
 	} else {
 		// Populate new table entry
 		tableused++;
 		found->tag = tag;
+		found->flags = newblob.h ? INNEWSTORE : 0;
+		found->fingerprint = h >> 16;
 		found->klen = klen;
 		found->vlen = vlen;
 
@@ -168,7 +459,7 @@ void HTinstall(int tag, const void *key, short klen, const void *val, short vlen
 			memcpy(found->key.inln, key, klen);
 		} else {
 			// Store outside the entry
-			found->key.offset = store(key, klen);
+			found->key.offset = store(target(), key, klen);
 		}
 
 		if (vlen <= 4) {
@@ -176,51 +467,191 @@ void HTinstall(int tag, const void *key, short klen, const void *val, short vlen
 			memcpy(found->val.inln, val, vlen);
 		} else {
 			// Store outside the entry
-			found->val.offset = store(val, vlen);
+			found->val.offset = store(target(), val, vlen);
 		}
 	}
 }
 
 void *HTlookup(int tag, const void *key, short klen) {
+#ifdef HTHOST
+	lookups++;
+#endif
 	struct entry *found = find(tag, key, klen);
-	if (!found || found->klen == 0) return NULL;
+	if (!found) return NULL;
 	return entryval(found);
 }
 
-static unsigned long hash(int tag, const void *key, short klen) {
-	unsigned long hashval = tag;
-	for (short i=0; i<klen; i++) {
-		hashval = hashval * 31 + ((unsigned char *)key)[i];
+// Remove by shifting later members of the probe sequence back (no tombstones)
+// The old table is different: it only drains, so a deleted entry is just marked
+void HTdelete(int tag, const void *key, short klen) {
+	migrate(MIGRATESTEP);
+
+	uint32_t h = hash(tag, key, klen);
+	struct entry *found = probe(table, tablesize, h, tag, key, klen);
+	if (!found || found->klen == 0) {
+		if (oldtable == NULL) return;
+		found = probe(oldtable, oldtablesize, h, tag, key, klen);
+		if (!found || found->klen == 0) return;
+
+		if (found->klen > 4) unstore(found, found->key.offset, found->klen);
+		if (found->vlen > 4) unstore(found, found->val.offset, found->vlen);
+		found->flags |= MOVED;
+		tableused--;
+		return;
+	}
+
+	if (found->klen > 4) unstore(found, found->key.offset, found->klen);
+	if (found->vlen > 4) unstore(found, found->val.offset, found->vlen);
+
+	size_t mask = tablesize - 1;
+	size_t hole = found - table;
+	for (size_t i=(hole+1)&mask; table[i].klen!=0; i=(i+1)&mask) {
+		size_t home = hash(table[i].tag, entrykey(&table[i]), table[i].klen) & mask;
+
+		// Can only move back if the hole is not before this entry's home
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			table[hole] = table[i];
+			// Moved behind the compactor, which won't come back for it
+			if (newblob.h && hole < compactCursor) compactEntry(&table[hole]);
+			hole = i;
+		}
+	}
+
+	memset(&table[hole], 0, sizeof table[hole]);
+	tableused--;
+}
+
+// Can a new entry this size be added without the table wanting to grow?
+// Check before adding in bulk, and back off (or HTallocate if safe) if not
+int HTroom(short klen, short vlen) {
+	struct store *s = target();
+
+	size_t bytes = 0;
+	if (klen > 4) bytes += (klen + 7) & -8;
+	if (vlen > 4) bytes += (vlen + 7) & -8;
+
+	return tableused < tablesize/2 && s->used < s->size/2 && s->used + bytes <= s->size;
+}
+
+// Walk every entry with a given tag, in no particular order
+// Start with *cursor = 0, returns NULL at the end
+// Don't HTinstall or HTdelete during the walk: entries might move
+// (HTlookup is fine, it never migrates anything)
+void *HTiterate(int tag, size_t *cursor, const void **key, short *klen, short *vlen) {
+	while (*cursor < tablesize + oldtablesize) {
+		size_t i = (*cursor)++;
+		struct entry *e = i < tablesize ? &table[i] : &oldtable[i - tablesize];
+		if (e->klen == 0 || (e->flags & MOVED) || e->tag != (char)tag) continue;
+
+		if (key) *key = entrykey(e);
+		if (klen) *klen = e->klen;
+		if (vlen) *vlen = e->vlen;
+		return entryval(e);
+	}
+	return NULL;
+}
+
+// Most keys are 4-byte CNIDs: skip the byte loop and go straight to a
+// multiplicative (Fibonacci) hash, folded so that the low bits used to index
+// the table depend on every key bit. Longer keys get the same finish.
+static uint32_t hash(int tag, const void *key, short klen) {
+	uint32_t hashval;
+	if (klen == 4) {
+		memcpy(&hashval, key, 4);
+		hashval ^= (uint32_t)(unsigned char)tag << 24;
+	} else {
+		hashval = (char)tag;
+		for (short i=0; i<klen; i++) {
+			hashval = hashval * 31 + ((unsigned char *)key)[i];
+		}
 	}
-	return hashval;
+
+	hashval *= 0x9e3779b1;
+	return hashval ^ (hashval >> 16);
 }
 
-// Ensure at least this many bytes at bump
-// Bump-allocate inside our large block
-static size_t store(const void *data, size_t bytes) {
-	if (blobused + bytes > blobsize) {
-		panic("Hash table out of storage area!");
+// Reuse a free chunk of exactly the right size, or else bump-allocate
+static size_t store(struct store *s, const void *data, size_t bytes) {
+	size_t room = (bytes + 7) & -8; // everything aligned to 8 bytes forever
+	size_t ret = 0;
+
+	if (room/8 < NCLASS) {
+		ret = s->freelist[room/8];
+		if (ret) s->freelist[room/8] = ((struct freechunk *)(*s->h + ret))->next;
+	} else {
+		for (uint32_t *link=&s->bigfree; *link; link=&((struct freechunk *)(*s->h + *link))->next) {
+			struct freechunk *c = (void *)(*s->h + *link);
+			if (c->size == room) {
+				ret = *link;
+				*link = c->next;
+				break;
+			}
+		}
 	}
 
-	memcpy(*blob + blobused, data, bytes);
+	if (ret) {
+		s->freed -= room;
+	} else {
+		if (s->used + room > s->size) {
+			panic("Hash table out of storage area!");
+		}
+		ret = s->used;
+		s->used += room;
+	}
 
-	size_t ret = blobused;
-	blobused += (bytes + 7) & -8; // everything aligned to 8 bytes forever
+	memcpy(*s->h + ret, data, bytes);
 	return ret;
 }
 
-static struct entry *find(int tag, const void *key, short klen) {
-	unsigned long start = hash(tag, key, klen);
+// Give back a chunk belonging to an entry
+static void unstore(struct entry *e, size_t offset, size_t bytes) {
+	// The old store is about to go, so don't bother
+	if (newblob.h && !(e->flags & INNEWSTORE)) return;
 
-	for (size_t i=0; i<tablesize; i++) {
-		unsigned long probe = (start + i) & (tablesize - 1);
-		struct entry *e = &table[probe];
+	struct store *s = target();
+	size_t room = (bytes + 7) & -8;
+
+	// At the end? Just un-bump
+	if (offset + room == s->used) {
+		s->used -= room;
+		return;
+	}
+
+	struct freechunk *c = (void *)(*s->h + offset);
+	c->size = room;
+	if (room/8 < NCLASS) {
+		c->next = s->freelist[room/8];
+		s->freelist[room/8] = offset;
+	} else {
+		c->next = s->bigfree;
+		s->bigfree = offset;
+	}
+	s->freed += room;
+}
+
+static struct entry *probe(struct entry *t, size_t size, uint32_t h, int tag, const void *key, short klen) {
+	unsigned short fingerprint = h >> 16;
+
+	// 4-byte keys are always inline, so compare them as integers
+	uint32_t key4 = 0;
+	if (klen == 4) memcpy(&key4, key, 4);
+
+	for (size_t i=0; i<size; i++) {
+		struct entry *e = &t[(h + i) & (size - 1)];
 
 		if (e->klen == 0) {
 			return e; // key not found, but here is where to put it
 		}
 
-		if (e->tag == tag && e->klen == klen && !memcmp(entrykey(e), key, klen)) {
+		// MOVED entries are still part of the probe sequence
+		if (e->fingerprint != fingerprint || e->klen != klen ||
+			e->tag != (char)tag || (e->flags & MOVED)) continue;
+
+		if (klen == 4) {
+			uint32_t ekey4;
+			memcpy(&ekey4, e->key.inln, 4);
+			if (ekey4 == key4) return e;
+		} else if (!memcmp(entrykey(e), key, klen)) {
 			return e;
 		}
 	}
@@ -228,11 +659,26 @@ static struct entry *find(int tag, const void *key, short klen) {
 	return NULL; // key not found AND the table is full (very bad)
 }
 
+// Find a live entry in either table
+static struct entry *find(int tag, const void *key, short klen) {
+	uint32_t h = hash(tag, key, klen);
+	struct entry *e = probe(table, tablesize, h, tag, key, klen);
+	if (e && e->klen != 0) return e;
+	if (oldtable == NULL) return NULL;
+	e = probe(oldtable, oldtablesize, h, tag, key, klen);
+	if (e && e->klen != 0) return e;
+	return NULL;
+}
+
+static char *entrystore(struct entry *e) {
+	return (e->flags & INNEWSTORE) ? *newblob.h : *blob.h;
+}
+
 static void *entrykey(struct entry *e) {
 	if (e->klen <= 4) {
 		return e->key.inln;
 	} else {
-		return *blob + e->key.offset;
+		return entrystore(e) + e->key.offset;
 	}
 }
 
@@ -240,7 +686,7 @@ static void *entryval(struct entry *e) {
 	if (e->vlen <= 4) {
 		return e->val.inln;
 	} else {
-		return *blob + e->val.offset;
+		return entrystore(e) + e->val.offset;
 	}
 }
 
@@ -265,15 +711,261 @@ static void dump(void) {
 	}
 }
 
-#include <stdio.h>
+#ifdef HTHOST
+// Fill a fresh table of a given size to a given load, then time lookups
+// Long keys look like filenames, the usual case for them
+static void benchkey(char *key, uint32_t i, short klen) {
+	if (klen == 4) {
+		memcpy(key, &i, 4);
+	} else {
+		memset(key, 0, klen);
+		snprintf(key, klen, "Untitled Folder %u", (unsigned)i);
+	}
+}
+
+static void bench(size_t slots, int percent, short klen) {
+	if (table) DisposePtr((void *)table);
+	table = (void *)NewPtrSysClear(slots * sizeof (struct entry));
+	tablesize = slots;
+	tableused = 0;
+
+	size_t n = slots * percent / 100;
+	char key[32] = {};
+	for (uint32_t i=0; i<n; i++) {
+		benchkey(key, i, klen);
+		HTinstall('B', key, klen, &i, 4);
+	}
+
+	// Probe lengths from the table layout itself
+	size_t mask = tablesize - 1, hitprobes = 0, missprobes = 0;
+	for (size_t i=0; i<tablesize; i++) {
+		if (table[i].klen != 0) {
+			size_t home = hash(table[i].tag, entrykey(&table[i]), table[i].klen) & mask;
+			hitprobes += ((i - home) & mask) + 1;
+		}
+		size_t run = 1;
+		while (table[(i + run - 1) & mask].klen != 0) run++;
+		missprobes += run;
+	}
+
+	// Half hits, half misses
+	enum {LOOKUPS = 10000000};
+	uint32_t found = 0;
+	clock_t t = clock();
+	for (uint32_t i=0; i<LOOKUPS; i++) {
+		uint32_t k = (i * 2654435761u) % (2 * n);
+		benchkey(key, k, klen);
+		found += HTlookup('B', key, klen) != NULL;
+	}
+	double secs = (double)(clock() - t) / CLOCKS_PER_SEC;
+
+	printf("%2d%% load, %2d-byte keys: %5.1fM lookups/sec, %.2f probes/hit, %.2f probes/miss (%d hits)\n",
+		percent, klen, LOOKUPS / secs / 1e6,
+		(double)hitprobes / n, (double)missprobes / tablesize, (int)found);
+}
+
+// A delete shifts an entry back across the compactor's cursor
+// Two keys share home slot 1023, so the second lands in 1024. One step
+// copies slot 1023 only, then deleting the first key pulls the second back
+// into 1023, where the compactor has already been.
+static void compactTest(void) {
+	enum {HOME = 1023, KLEN = 24};
+	char keys[2][KLEN] = {};
+	uint32_t vals[2][2] = {{0x11111111, 0x22222222}, {0x33333333, 0x44444444}};
+
+	int n = 0;
+	for (uint32_t i=0; n<2; i++) {
+		benchkey(keys[n], i, KLEN);
+		if ((hash('C', keys[n], KLEN) & (tablesize - 1)) == HOME) n++;
+	}
+	HTinstall('C', keys[0], KLEN, vals[0], sizeof vals[0]);
+	HTinstall('C', keys[1], KLEN, vals[1], sizeof vals[1]);
+
+	compactStart();
+	compactStep();
+	HTdelete('C', keys[0], KLEN);
+	while (newblob.h) compactStep();
+
+	uint32_t *got = HTlookup('C', keys[1], KLEN);
+	if (!got || memcmp(got, vals[1], sizeof vals[1])) {
+		printf("Delete during compaction lost an entry\n");
+		exit(1);
+	}
+	printf("Delete during compaction OK\n");
+	HTdelete('C', keys[1], KLEN);
+}
+
+// The CNID database (cniddb.c) on a made-up share, against the layout it had
+// before names were pooled: parent and name in every '$' record, and a
+// setPath that called getDBName and getDBParent twice per component
+enum {DBMAX = 16384};
+static struct {int32_t cnid, parent; char name[32];} dbTree[DBMAX];
+static int dbCount;
+
+static int32_t dbAdd(int32_t parent, const char *fmt, unsigned n) {
+	int32_t cnid = 16 + dbCount;
+	dbTree[dbCount].cnid = cnid;
+	dbTree[dbCount].parent = parent;
+	snprintf(dbTree[dbCount].name, sizeof dbTree[0].name, fmt, n);
+	dbCount++;
+	return cnid;
+}
+
+// Unique names mostly, with the usual repeats: an application named after
+// its folder, "Read Me" and "Plug-ins" everywhere, and the same plug-ins
+static void dbMakeTree(void) {
+	int32_t sys = dbAdd(2, "System Folder", 0);
+	int32_t ext = dbAdd(sys, "Extensions", 0);
+	for (unsigned i=0; i<300; i++) dbAdd(ext, "Extension %u", i);
+	int32_t prefs = dbAdd(sys, "Preferences", 0);
+	for (unsigned i=0; i<300; i++) dbAdd(prefs, "Application %u Prefs", i);
+
+	int32_t apps = dbAdd(2, "Applications", 0);
+	for (unsigned i=0; i<300; i++) {
+		int32_t app = dbAdd(apps, "Application %u", i);
+		dbAdd(app, "Application %u", i);
+		dbAdd(app, "Read Me", 0);
+		dbAdd(app, "Help", 0);
+		int32_t plug = dbAdd(app, "Plug-ins", 0);
+		for (unsigned j=0; j<10; j++) dbAdd(plug, "Plug-in %u", (i + j) % 40);
+		int32_t ex = dbAdd(app, "Examples", 0);
+		for (unsigned j=0; j<15; j++) dbAdd(ex, "Example Document %u", i*15 + j);
+	}
+
+	int32_t proj = dbAdd(2, "Projects", 0);
+	for (unsigned i=0; i<200; i++) {
+		int32_t p = dbAdd(proj, "Project %u", i);
+		dbAdd(p, "Makefile", 0);
+		dbAdd(p, "README", 0);
+		int32_t src = dbAdd(p, "src", 0);
+		for (unsigned j=0; j<15; j++) dbAdd(src, "source%u.c", i*15 + j);
+	}
+}
+
+static const char *oldName(int32_t cnid) {
+	char *rec = HTlookup('b', &cnid, sizeof cnid);
+	return rec ? rec + 4 : NULL;
+}
+
+static int32_t oldParent(int32_t cnid) {
+	int32_t *rec = HTlookup('b', &cnid, sizeof cnid);
+	return rec ? *rec : 0;
+}
+
+static void dbReport(const char *what, size_t entries, size_t bytes, size_t n, size_t comps, double secs) {
+	printf("%-12s %5.2f entries/file, %5.1f bytes/file, %.2f lookups/component, %.2f us/path\n",
+		what, (double)entries / dbCount, (double)bytes / dbCount,
+		(double)n / comps, secs * 1e6 / dbCount);
+}
+
+static void dbBench(void) {
+	if (table) DisposePtr((void *)table);
+	table = (void *)NewPtrSysClear((1<<16) * sizeof (struct entry));
+	tablesize = 1<<16;
+	tableused = 0;
+
+	dbMakeTree();
+
+	enum {ROUNDS = 20};
+	char path[512], *comps[100];
+	int32_t cnids[100];
+	size_t entries = tableused, bytes = blob.used - blob.freed, ncomps = 0, n;
+
+	// Before
+	for (int i=0; i<dbCount; i++) {
+		char rec[4 + 32];
+		memcpy(rec, &dbTree[i].parent, 4);
+		strcpy(rec + 4, dbTree[i].name);
+		HTinstall('b', &dbTree[i].cnid, 4, rec, 4 + strlen(dbTree[i].name) + 1);
+	}
+	entries = tableused - entries;
+	bytes = blob.used - blob.freed - bytes;
+
+	n = lookups;
+	clock_t t = clock();
+	for (int r=0; r<ROUNDS; r++) {
+		for (int i=0; i<dbCount; i++) {
+			int nbytes = 0, npath = 0;
+			for (int32_t c=dbTree[i].cnid; c!=2; c=oldParent(c)) {
+				nbytes += strlen(oldName(c)) + 1;
+				npath++;
+			}
+			for (int32_t c=dbTree[i].cnid; c!=2; c=oldParent(c)) {
+				const char *name = oldName(c);
+				npath--;
+				nbytes -= strlen(name) + 1;
+				comps[npath] = strcpy(path + nbytes, name);
+			}
+		}
+	}
+	double secs = (double)(clock() - t) / CLOCKS_PER_SEC / ROUNDS;
+	n = (lookups - n) / ROUNDS;
+	for (int i=0; i<dbCount; i++) {
+		for (int32_t c=dbTree[i].cnid; c!=2; c=oldParent(c)) ncomps++;
+	}
+	dbReport("Inline names", entries, bytes, n, ncomps, secs);
+
+	// After
+	entries = tableused;
+	bytes = blob.used - blob.freed;
+	for (int i=0; i<dbCount; i++) setDB(dbTree[i].cnid, dbTree[i].parent, dbTree[i].name);
+	entries = tableused - entries;
+	bytes = blob.used - blob.freed - bytes;
+
+	n = lookups;
+	t = clock();
+	for (int r=0; r<ROUNDS; r++) {
+		for (int i=0; i<dbCount; i++) {
+			int nbytes = sizeof path;
+			if (pathDB(dbTree[i].cnid, path, &nbytes, comps, cnids, 100) < 0) {
+				printf("CNID database lost %d\n", (int)dbTree[i].cnid);
+				exit(1);
+			}
+		}
+	}
+	secs = (double)(clock() - t) / CLOCKS_PER_SEC / ROUNDS;
+	n = (lookups - n) / ROUNDS;
+	dbReport("cniddb.c", entries, bytes, n, ncomps, secs);
+
+	// Forgetting everything must empty the pool too
+	for (int i=0; i<dbCount; i++) forgetDB(dbTree[i].cnid);
+	size_t cursor = 0;
+	if (HTiterate('I', &cursor, NULL, NULL, NULL)) {
+		printf("CNID database leaked a pooled name\n");
+		exit(1);
+	}
+}
+
 int main(int argc, char **argv) {
 #define SETSTR(k, v) HTinstall(0, k, strlen(k)+1, v, strlen(v)+1)
 #define GETSTR(k) ((char *)HTlookup(0, k, strlen(k)+1))
 
+	HTallocate();
+	compactTest();
+
 	SETSTR("one", "alpha");
 	SETSTR("two", "beta");
 	SETSTR("three", "gamma");
 	SETSTR("one", "something else");
 
 	printf("%s %s %s\n", GETSTR("one"), GETSTR("two"), GETSTR("three"));
+
+	HTdelete(0, "two", 4);
+	SETSTR("four", "delta"); // reuses the chunk freed by "two"
+
+	printf("%s %s %s\n", GETSTR("one"), GETSTR("two") ? "oops" : "(deleted)", GETSTR("four"));
+
+	// The store is needed for the long keys
+	blob.used = 8;
+	memset(blob.freelist, 0, sizeof blob.freelist);
+	blob.bigfree = blob.freed = 0;
+	SetHandleSize(blob.h, 64*1024*1024);
+	blob.size = 64*1024*1024;
+
+	dbBench();
+	bench(1<<20, 25, 4);
+	bench(1<<20, 50, 4);
+	bench(1<<20, 25, 24);
+	bench(1<<20, 50, 24);
 }
+#endif
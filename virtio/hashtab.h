@@ -1,6 +1,12 @@
 #pragma once
 
+#include <stddef.h>
+
 void HTallocate(void);
 void HTallocatelater(void);
+void HTreserve(size_t entries, size_t bytes);
 void HTinstall(int tag, const void *key, short klen, const void *val, short vlen);
 void *HTlookup(int tag, const void *key, short klen);
+void HTdelete(int tag, const void *key, short klen);
+int HTroom(short klen, short vlen);
+void *HTiterate(int tag, size_t *cursor, const void **key, short *klen, short *vlen);
@@ -0,0 +1,205 @@
+// Microbenchmarks for 9p.c, run against the in-process server
+// Builds a scratch tree in /tmp, prints times, and cleans up
+// (9p.h has its own O_ and E constants, so no fcntl.h or errno.h here)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../9p.h"
+#include "host9p.h"
+
+enum {
+	ROOTFID = 2,
+	WALKFID = 3,
+	DIRFID = 4,
+	FILEFID = 5,
+	DEPTH = 16,
+	BIGDIR = 10000,
+	FILESIZE = 16*1024*1024,
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int err, const char *what) {
+	if (err) {
+		fprintf(stderr, "%s failed: errno %d\n", what, err);
+		exit(1);
+	}
+}
+
+static void makeTree(const char *root) {
+	char path[4096];
+
+	// deep/d/d/d/...
+	snprintf(path, sizeof path, "%s/deep", root);
+	mkdir(path, 0777);
+	for (int i=0; i<DEPTH; i++) {
+		strcat(path, "/d");
+		mkdir(path, 0777);
+	}
+
+	snprintf(path, sizeof path, "%s/big", root);
+	mkdir(path, 0777);
+	for (int i=0; i<BIGDIR; i++) {
+		snprintf(path, sizeof path, "%s/big/Untitled Folder %d", root, i);
+		fclose(fopen(path, "w"));
+	}
+
+	snprintf(path, sizeof path, "%s/data", root);
+	fclose(fopen(path, "w"));
+	truncate(path, FILESIZE);
+}
+
+static void benchWalk(void) {
+	const char *names[DEPTH+1] = {"deep"};
+	for (int i=1; i<=DEPTH; i++) names[i] = "d";
+
+	for (int depth=1; depth<=DEPTH+1; depth*=2) {
+		enum {N = 20000};
+		double t = now();
+		for (int i=0; i<N; i++) {
+			check(Walk9(ROOTFID, WALKFID, depth, names, NULL, NULL), "Walk9");
+		}
+		t = now() - t;
+		printf("Walk9 %2d components:      %7.2f us/call\n", depth, t / N * 1e6);
+	}
+}
+
+static void benchReaddir(void) {
+	static char buf[64*1024];
+	check(Walk9(ROOTFID, DIRFID, 1, (const char *[]){"big"}, NULL, NULL), "Walk9");
+	check(Lopen9(DIRFID, O_RDONLY|O_DIRECTORY, NULL, NULL), "Lopen9");
+
+	for (size_t bufsize=4096; bufsize<=sizeof buf; bufsize*=4) {
+		enum {N = 20};
+		uint32_t before = Roundtrips9;
+		int entries = 0;
+		double t = now();
+		for (int i=0; i<N; i++) {
+			InitReaddir9(DIRFID, buf, bufsize);
+			char name[512];
+			while (Readdir9(buf, NULL, NULL, name) == 0) entries++;
+		}
+		t = now() - t;
+		printf("Readdir9 %d entries, %5zu-byte buffer: %6.2f ms/listing, %lu round trips\n",
+			entries / N, bufsize, t / N * 1e3, (unsigned long)(Roundtrips9 - before) / N);
+	}
+
+	Clunk9(DIRFID);
+}
+
+static void benchIO(void) {
+	static char buf[SERVERMSIZE];
+	check(Walk9(ROOTFID, FILEFID, 1, (const char *[]){"data"}, NULL, NULL), "Walk9");
+	check(Lopen9(FILEFID, O_RDWR, NULL, NULL), "Lopen9");
+
+	uint32_t sizes[] = {512, 4096, 32768, 262144, Max9};
+	for (int s=0; s<sizeof sizes/sizeof *sizes; s++) {
+		uint32_t size = sizes[s], got;
+
+		double t = now();
+		for (uint64_t off=0; off<FILESIZE; off+=size) {
+			check(Read9(FILEFID, buf, off, size, &got), "Read9");
+		}
+		double rt = now() - t;
+
+		t = now();
+		for (uint64_t off=0; off<FILESIZE; off+=size) {
+			check(Write9(FILEFID, buf, off, size, &got), "Write9");
+		}
+		double wt = now() - t;
+
+		printf("Read9/Write9 %7lu bytes:  %7.1f / %7.1f MB/s\n",
+			(unsigned long)size, FILESIZE / rt / 1e6, FILESIZE / wt / 1e6);
+	}
+
+	// The pipelined calls must give back exactly what went in
+	for (uint32_t i=0; i<sizeof buf; i++) buf[i] = i * 2654435761u >> 24;
+	uint32_t got;
+	check(WriteMany9(FILEFID, buf, 12345, sizeof buf, &got), "WriteMany9");
+	if (got != sizeof buf) check(-1, "WriteMany9 count");
+	static char back[SERVERMSIZE];
+	check(ReadMany9(FILEFID, back, 12345, sizeof back, &got), "ReadMany9");
+	if (got != sizeof back || memcmp(buf, back, sizeof buf)) check(-1, "ReadMany9 data");
+	struct Stat9 st; // the Write9 loop above may have overshot FILESIZE
+	check(Getattr9(FILEFID, STAT_SIZE, &st), "Getattr9");
+	check(ReadMany9(FILEFID, back, st.size - 1000, sizeof back, &got), "ReadMany9 at EOF");
+	if (got != 1000) check(-1, "ReadMany9 short count");
+
+	// A failed write in the middle of the pipe is an error, and the count
+	// covers only the chunks before it (the later ones still land)
+	ServerFailWrite = 2;
+	if (!WriteMany9(FILEFID, buf, st.size, sizeof buf, &got)) check(-1, "WriteMany9 error");
+	if (got == 0 || got == sizeof buf) check(-1, "WriteMany9 count after error");
+	uint32_t got2;
+	check(ReadMany9(FILEFID, back, st.size, got, &got2), "ReadMany9");
+	if (got2 != got || memcmp(buf, back, got)) check(-1, "WriteMany9 data before error");
+
+	for (uint32_t size=65536; size<=sizeof buf; size*=4) {
+		uint32_t before = Roundtrips9;
+		double t = now();
+		for (uint64_t off=0; off<FILESIZE; off+=size) {
+			check(ReadMany9(FILEFID, buf, off, size, &got), "ReadMany9");
+		}
+		double rt = now() - t;
+
+		t = now();
+		for (uint64_t off=0; off<FILESIZE; off+=size) {
+			check(WriteMany9(FILEFID, buf, off, size, &got), "WriteMany9");
+		}
+		double wt = now() - t;
+
+		printf("ReadMany9/WriteMany9 %7lu bytes: %7.1f / %7.1f MB/s, %lu requests each\n",
+			(unsigned long)size, FILESIZE / rt / 1e6, FILESIZE / wt / 1e6,
+			(unsigned long)(Roundtrips9 - before) / 2 / (FILESIZE / size));
+	}
+
+	Clunk9(FILEFID);
+}
+
+// Mostly transact() itself: Getattr9 decodes the most fields,
+// and Clunk9 of a bad fid is about the least work the server can do
+static void benchTransact(void) {
+	enum {N = 200000};
+	struct Stat9 st;
+
+	double t = now();
+	for (int i=0; i<N; i++) check(Getattr9(ROOTFID, STAT_ALL, &st), "Getattr9");
+	t = now() - t;
+	printf("Getattr9:                 %7.3f us/call\n", t / N * 1e6);
+
+	t = now();
+	for (int i=0; i<N; i++) Clunk9(1000);
+	t = now() - t;
+	printf("Clunk9 (Rlerror):         %7.3f us/call\n", t / N * 1e6);
+}
+
+int main(int argc, char **argv) {
+	char root[] = "/tmp/bench9p-XXXXXX";
+	if (!mkdtemp(root)) return 1;
+	printf("Building tree in %s\n", root);
+	makeTree(root);
+
+	ServerInit9(root);
+	check(Init9(256), "Init9");
+	check(Attach9(ROOTFID, NOFID, "", "", 0, NULL), "Attach9");
+	printf("Max9 = %lu\n", (unsigned long)Max9);
+
+	benchWalk();
+	benchReaddir();
+	benchIO();
+	benchTransact();
+
+	char cmd[64];
+	snprintf(cmd, sizeof cmd, "rm -rf %s", root);
+	return system(cmd);
+}
@@ -0,0 +1,189 @@
+// Correctness and speed of blit.c, for every depth
+// Checks Blit against a pixel-at-a-time reference (including the rounding
+// of l and r to BlitterAlign), then prints megapixels per second
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../blit.h"
+
+enum {
+	W = 1031, // odd, so the right-edge rounding is exercised
+	H = 768,
+	BENCHW = 1024,
+	CANARY = 0xdeadbeef,
+};
+
+static uint8_t red[256], grn[256], blu[256];
+static uint32_t clut[256];
+static uint32_t clut15[32768];
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Same as rowbytesForBack in device-gpu.c
+static long rowbytesFor(int bppshift, long width) {
+	long size = ((width << bppshift) + 7) / 8;
+	long bytealign = BlitterAlign[bppshift];
+	return (size + bytealign - 1) & -bytealign;
+}
+
+// Pixels are read the way the blitters read them: bytes at 8 bits, otherwise
+// native words with the leftmost pixel most significant. On a big-endian
+// Mac that is exactly QuickDraw's layout.
+static uint32_t getPixel(const void *row, int bppshift, long x) {
+	int bpp = 1 << bppshift;
+
+	if (bppshift == 3) return ((const uint8_t *)row)[x];
+	if (bppshift == 5) return ((const uint32_t *)row)[x];
+
+	uint32_t word = ((const uint32_t *)row)[x * bpp / 32];
+	int shift = 32 - bpp - (x * bpp % 32);
+	return (word >> shift) & ((1 << bpp) - 1);
+}
+
+static uint32_t expand5(uint32_t c) {
+	return (c << 3) | (c >> 2);
+}
+
+static uint32_t reference(int bppshift, uint32_t s) {
+	if (bppshift <= 3) {
+		return clut[s];
+	} else if (bppshift == 4) {
+		return ((uint32_t)blu[expand5(s & 0x1f)] << 24) |
+			((uint32_t)grn[expand5((s >> 5) & 0x1f)] << 16) |
+			((uint32_t)red[expand5((s >> 10) & 0x1f)] << 8);
+	} else {
+		return ((uint32_t)blu[s & 0xff] << 24) |
+			((uint32_t)grn[(s >> 8) & 0xff] << 16) |
+			((uint32_t)red[(s >> 16) & 0xff] << 8);
+	}
+}
+
+static uint32_t *clutFor(int bppshift) {
+	return bppshift == 4 ? clut15 : clut;
+}
+
+static int checkOne(int bppshift, short t, short l, short b, short r, void *src, uint32_t *dst) {
+	long rowbytes = rowbytesFor(bppshift, W);
+	long dstpix = rowbytes << (5 - bppshift) >> 2;
+	long pixalign = (long)BlitterAlign[bppshift] << 3 >> bppshift;
+	short wantl = l & -pixalign, wantr = (r + pixalign - 1) & -pixalign;
+	short gotl = l, gotr = r;
+
+	for (long i=0; i<dstpix*H; i++) dst[i] = CANARY;
+
+	Blit(bppshift, t, &gotl, b, &gotr, src, dst, rowbytes, clutFor(bppshift), red, grn, blu);
+
+	if (gotl != wantl || gotr != wantr) {
+		printf("FAIL %2d-bit (%d,%d,%d,%d): returned l=%d r=%d, expected l=%d r=%d\n",
+			1 << bppshift, t, l, b, r, gotl, gotr, wantl, wantr);
+		return 1;
+	}
+
+	for (long y=0; y<H; y++) {
+		for (long x=0; x<dstpix; x++) {
+			uint32_t want = CANARY;
+			if (y >= t && y < b && x >= wantl && x < wantr) {
+				want = reference(bppshift, getPixel((char *)src + y*rowbytes, bppshift, x));
+			}
+
+			if (dst[y*dstpix + x] != want) {
+				printf("FAIL %2d-bit (%d,%d,%d,%d): pixel %ld,%ld is %08x, expected %08x\n",
+					1 << bppshift, t, l, b, r, x, y, dst[y*dstpix + x], want);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int checkAll(void *src, uint32_t *dst) {
+	static const short lefts[] = {0, 1, 3, 7, 8, 17, 31, 32, 33, 500};
+	static const short widths[] = {1, 2, 5, 16, 31, 32, 33, 64, 100, 531};
+	int fails = 0, n = 0;
+
+	for (int bppshift=0; bppshift<=5; bppshift++) {
+		for (int i=0; i<sizeof lefts/sizeof *lefts; i++) {
+			for (int j=0; j<sizeof widths/sizeof *widths; j++) {
+				short l = lefts[i], r = l + widths[j];
+				fails += checkOne(bppshift, 5, l, 9, r, src, dst);
+				n++;
+			}
+		}
+
+		// Whole screen, including the ragged right edge
+		fails += checkOne(bppshift, 0, 0, H, W, src, dst);
+		fails += checkOne(bppshift, H-3, W-1, H, W, src, dst);
+		n += 2;
+	}
+
+	printf("%d of %d rects correct\n", n - fails, n);
+	return fails;
+}
+
+static void bench(void *src, uint32_t *dst) {
+	static const struct {short w, h; const char *what;} sizes[] = {
+		{BENCHW, H, "full screen"},
+		{256, 64, "damage rect"},
+		{32, 32, "one tile"},
+		{16, 16, "cursor"},
+	};
+
+	for (int bppshift=0; bppshift<=5; bppshift++) {
+		long rowbytes = rowbytesFor(bppshift, W);
+
+		printf("%2d-bit:", 1 << bppshift);
+		for (int s=0; s<sizeof sizes/sizeof *sizes; s++) {
+			short w = sizes[s].w, h = sizes[s].h;
+			long pixels = 0;
+			double t = now(), elapsed;
+
+			// Step the rect around so that it is not always cached
+			do {
+				for (int i=0; i<64; i++) {
+					short top = (i * 37) % (H - h + 1);
+					short l = (i * 101) % (BENCHW - w + 1), r = l + w;
+					Blit(bppshift, top, &l, top + h, &r, src, dst, rowbytes, clutFor(bppshift), red, grn, blu);
+					pixels += (long)(r - l) * h;
+				}
+				elapsed = now() - t;
+			} while (elapsed < 0.2);
+
+			printf("  %s %7.1f", sizes[s].what, pixels / elapsed / 1e6);
+		}
+		printf(" Mpx/s\n");
+	}
+}
+
+int main(int argc, char **argv) {
+	size_t srcsize = 0, dstsize = 0;
+	for (int bppshift=0; bppshift<=5; bppshift++) {
+		// Rounding up to BlitterAlign makes the shallow depths the widest
+		size_t rowbytes = rowbytesFor(bppshift, W);
+		if (srcsize < rowbytes * H) srcsize = rowbytes * H;
+		if (dstsize < (rowbytes << (5 - bppshift)) * H) dstsize = (rowbytes << (5 - bppshift)) * H;
+	}
+	uint8_t *src = malloc(srcsize);
+	uint32_t *dst = malloc(dstsize);
+
+	srand(1);
+	for (size_t i=0; i<srcsize; i++) src[i] = rand();
+	for (int i=0; i<256; i++) {
+		red[i] = rand();
+		grn[i] = rand();
+		blu[i] = rand();
+		clut[i] = (uint32_t)rand() << 8;
+	}
+	BlitTable15(clut15, red, grn, blu);
+
+	if (checkAll(src, dst)) return 1;
+	bench(src, dst);
+	return 0;
+}
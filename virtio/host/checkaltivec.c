@@ -0,0 +1,118 @@
+// Correctness of blit-altivec-ndrv.c, on emulated intrinsics (mac/altivec.h)
+// Checks BlitAltivec against a pixel-at-a-time reference at 16 and 32 bits.
+// Only the logic is tested: the speed on a G4 has to be measured on a G4.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../blit.h"
+
+enum {
+	W = 1031,
+	H = 16,
+	CANARY = 0xa5,
+};
+
+static uint8_t red[256], grn[256], blu[256];
+
+static uint32_t expand5(uint32_t c) {
+	return (c << 3) | (c >> 2);
+}
+
+// The 32-bit source is built byte by byte as xRGB, the big-endian layout
+// the AltiVec code expects, whatever the host's byte order
+static void reference(int bppshift, const uint8_t *srcrow, long x, uint8_t out[4]) {
+	if (bppshift == 4) {
+		uint16_t s;
+		memcpy(&s, srcrow + x*2, 2);
+		out[0] = blu[expand5(s & 0x1f)];
+		out[1] = grn[expand5((s >> 5) & 0x1f)];
+		out[2] = red[expand5((s >> 10) & 0x1f)];
+	} else {
+		out[0] = blu[srcrow[x*4 + 3]];
+		out[1] = grn[srcrow[x*4 + 2]];
+		out[2] = red[srcrow[x*4 + 1]];
+	}
+	out[3] = 0;
+}
+
+static int checkOne(int bppshift, short t, short l, short b, short r, const uint8_t *src, uint8_t *dst) {
+	long rowbytes = (long)W << bppshift >> 3;
+	long rowbytes_dest = (long)W * 4;
+
+	memset(dst, CANARY, rowbytes_dest * H);
+	if (!BlitAltivec(bppshift, t, l, b, r, src, dst, rowbytes, red, grn, blu)) {
+		printf("FAIL %d-bit (%d,%d,%d,%d): declined\n", 1 << bppshift, t, l, b, r);
+		return 1;
+	}
+
+	for (long y=0; y<H; y++) {
+		for (long x=0; x<W; x++) {
+			uint8_t want[4] = {CANARY, CANARY, CANARY, CANARY};
+			if (y >= t && y < b && x >= l && x < r) reference(bppshift, src + y*rowbytes, x, want);
+
+			if (memcmp(dst + y*rowbytes_dest + x*4, want, 4)) {
+				const uint8_t *got = dst + y*rowbytes_dest + x*4;
+				printf("FAIL %d-bit (%d,%d,%d,%d): pixel %ld,%ld is %02x%02x%02x%02x, expected %02x%02x%02x%02x\n",
+					1 << bppshift, t, l, b, r, x, y,
+					got[0], got[1], got[2], got[3], want[0], want[1], want[2], want[3]);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int checkAll(const char *what, int bppshift, const uint8_t *src, uint8_t *dst) {
+	static const short lefts[] = {0, 1, 3, 4, 5, 15, 16, 17, 500};
+	static const short widths[] = {1, 3, 4, 15, 16, 17, 31, 32, 33, 531};
+	int fails = 0, n = 0;
+
+	for (int i=0; i<sizeof lefts/sizeof *lefts; i++) {
+		for (int j=0; j<sizeof widths/sizeof *widths; j++) {
+			fails += checkOne(bppshift, 5, lefts[i], 9, lefts[i] + widths[j], src, dst);
+			n++;
+		}
+	}
+	fails += checkOne(bppshift, 0, 0, H, W, src, dst);
+	n++;
+
+	printf("%2d-bit %s: %d of %d rects correct\n", 1 << bppshift, what, n - fails, n);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	// 16-byte aligned, like the Mac's buffers, so the unaligned cases come
+	// from the rects alone
+	uint8_t *src = aligned_alloc(16, (size_t)W * 4 * H);
+	uint8_t *dst = aligned_alloc(16, (size_t)W * 4 * H);
+	int fails = 0;
+
+	srand(1);
+	for (size_t i=0; i<(size_t)W * 4 * H; i++) src[i] = rand();
+
+	// Thousands: separate tables per channel
+	for (int i=0; i<256; i++) {
+		red[i] = rand();
+		grn[i] = rand();
+		blu[i] = rand();
+	}
+	fails += checkAll("gamma", 4, src, dst);
+
+	// Millions: one table for all three channels, or none
+	for (int i=0; i<256; i++) red[i] = grn[i] = blu[i] = rand();
+	fails += checkAll("gamma", 5, src, dst);
+	for (int i=0; i<256; i++) red[i] = grn[i] = blu[i] = i;
+	fails += checkAll("identity", 5, src, dst);
+
+	// Three different tables are left to the scalar blitter
+	red[0] ^= 1;
+	if (BlitAltivec(5, 0, 0, 1, 1, src, dst, (long)W * 4, red, grn, blu)) {
+		printf("FAIL 32-bit: took separate tables\n");
+		fails++;
+	}
+
+	return fails != 0;
+}
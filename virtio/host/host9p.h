@@ -0,0 +1,18 @@
+// In-process 9P2000.L server for host testing (server9p.c)
+
+#pragma once
+
+#include <stddef.h>
+
+enum {
+	SERVERMSIZE = 1024*1024, // largest message either way
+};
+
+// Serve the directory at root, which must exist
+void ServerInit9(const char *root);
+
+// Handle one T-message, return the size of the R-message
+size_t Serve9(const void *t, size_t tlen, void *r, size_t rmax);
+
+// Fail the nth Twrite from now with EIO, to test error paths (0 = never)
+extern int ServerFailWrite;
@@ -0,0 +1,21 @@
+// Just enough of DriverServices.h to build 9p.c on the host
+// Logical and "physical" addresses are the same thing here
+
+#pragma once
+
+#include <stddef.h>
+
+typedef int OSStatus;
+typedef unsigned long ByteCount;
+typedef unsigned long ItemCount;
+typedef void *LogicalAddress;
+typedef void *PhysicalAddress;
+
+typedef struct MemoryBlock {
+	void *address;
+	ByteCount count;
+} MemoryBlock;
+
+OSStatus LockMemory(void *address, ByteCount count);
+OSStatus UnlockMemory(void *address, ByteCount count);
+OSStatus GetPhysical(void *addressRangeTable, ItemCount *numberOfExtents);
@@ -0,0 +1,19 @@
+// Just enough of Timer.h to use timing.h on the host
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+typedef struct UnsignedWide {
+	uint32_t hi;
+	uint32_t lo;
+} UnsignedWide;
+
+static inline void Microseconds(UnsignedWide *t) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	t->hi = us >> 32;
+	t->lo = us;
+}
@@ -0,0 +1,82 @@
+// Just enough of altivec.h to run blit-altivec-ndrv.c on the host
+// Vectors are GCC generic vectors, with elements in memory order as on a
+// big-endian G4. Element values are native, so a vector of shorts loaded from
+// native 16-bit pixels holds the pixels, just as on the Mac.
+// vec_ld and vec_st round the address down to 16 bytes, like lvx and stvx.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define vector __attribute__((vector_size(16)))
+#define bool unsigned
+
+typedef vector unsigned char altivec_u8;
+typedef vector unsigned short altivec_u16;
+
+#define vec_splat_u8(n) ((altivec_u8){} + (unsigned char)(n))
+#define vec_splat_u16(n) ((altivec_u16){} + (unsigned short)(n))
+
+#define vec_and(a, b) ((a) & (b))
+#define vec_sl(a, b) ((a) << (b))
+#define vec_sr(a, b) ((a) >> (b))
+#define vec_cmpeq(a, b) ((__typeof__(a))((a) == (b)))
+#define vec_sel(a, b, m) (((a) & ~(__typeof__(a))(m)) | ((b) & (__typeof__(a))(m)))
+
+static inline altivec_u8 vec_ld(long off, const void *p) {
+	altivec_u8 v;
+	memcpy(&v, (const void *)(((uintptr_t)p + off) & -16), 16);
+	return v;
+}
+
+static inline void vec_st(altivec_u8 v, long off, void *p) {
+	memcpy((void *)(((uintptr_t)p + off) & -16), &v, 16);
+}
+
+static inline altivec_u8 vec_lvsl(long off, const void *p) {
+	altivec_u8 v;
+	for (int i=0; i<16; i++) v[i] = (((uintptr_t)p + off) & 15) + i;
+	return v;
+}
+
+static inline altivec_u8 vec_perm(altivec_u8 a, altivec_u8 b, altivec_u8 c) {
+	altivec_u8 v;
+	for (int i=0; i<16; i++) v[i] = (c[i] & 16) ? b[c[i] & 15] : a[c[i] & 15];
+	return v;
+}
+
+// Modulo, keeping the low byte of each element
+static inline altivec_u8 vec_pack(altivec_u16 a, altivec_u16 b) {
+	altivec_u8 v;
+	for (int i=0; i<8; i++) {
+		v[i] = a[i];
+		v[8+i] = b[i];
+	}
+	return v;
+}
+
+static inline altivec_u8 altivec_merge8(altivec_u8 a, altivec_u8 b, int half) {
+	altivec_u8 v;
+	for (int i=0; i<8; i++) {
+		v[2*i] = a[half+i];
+		v[2*i+1] = b[half+i];
+	}
+	return v;
+}
+
+static inline altivec_u16 altivec_merge16(altivec_u16 a, altivec_u16 b, int half) {
+	altivec_u16 v;
+	for (int i=0; i<4; i++) {
+		v[2*i] = a[half+i];
+		v[2*i+1] = b[half+i];
+	}
+	return v;
+}
+
+#define vec_mergeh(a, b) _Generic((a), \
+	altivec_u8: altivec_merge8, \
+	altivec_u16: altivec_merge16)((a), (b), 0)
+#define vec_mergel(a, b) _Generic((a), \
+	altivec_u8: altivec_merge8, \
+	altivec_u16: altivec_merge16)((a), (b), sizeof (a) / sizeof (a)[0] / 2)
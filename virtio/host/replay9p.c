@@ -0,0 +1,345 @@
+// Replay a File Manager trace from device-9p.c (see dcTrace) through 9p.c
+// and the in-process server, profiled per selector the way fsCall is
+// (timing.h): microseconds and 9P round trips per call
+//
+//	replay9p TRACE DIR
+//
+// TRACE is the .fstrace file from the share, or a log with "Trace: <hex>"
+// lines. DIR should be a copy of the share that was traced. The driver itself
+// can't run on the host, so each call becomes the 9P requests it needs:
+// a walk and Tgetattr for a lookup, one listing per directory for indexed
+// calls, Tlopen for an open, pipelined reads, Tclunk for a close. Calls that
+// would change the share (create, delete, rename, write...) are counted but
+// not sent, so the same copy can be replayed again.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../9p.h"
+#include "../timing.h"
+#include "../unicode.h"
+#include "host9p.h"
+
+enum {
+	ROOTFID = 2,
+	WALKFID = 3,
+	DIRFID = 4,
+	OPENFID = 32, // one per open refnum from here
+	MAXOPEN = 256,
+	RECSIZE = 64, // struct traceRec in device-9p.c
+	MAXDIRS = 65536, // dirIDs learned from the trace, a power of two
+};
+
+struct rec {
+	uint16_t selector;
+	int16_t result;
+	uint32_t start, duration;
+	int32_t dirID, outDirID;
+	uint32_t count, actual, position;
+	uint16_t roundtrips;
+	int16_t vRefNum, refNum;
+	unsigned char name[26];
+};
+
+static const struct {uint16_t selector; const char *name;} names[] = {
+	{0xa000, "HOpen"}, {0xa001, "Close"}, {0xa002, "Read"}, {0xa003, "Write"},
+	{0xa007, "HGetVolInfo"}, {0xa008, "HCreate"}, {0xa009, "HDelete"}, {0xa00a, "HOpenRF"},
+	{0xa00b, "HRename"}, {0xa00c, "HGetFileInfo"}, {0xa00d, "HSetFileInfo"},
+	{0xa00e, "UnmountVol"}, {0xa00f, "MountVol"}, {0xa010, "Allocate"}, {0xa011, "GetEOF"},
+	{0xa012, "SetEOF"}, {0xa013, "FlushVol"}, {0xa014, "HGetVol"}, {0xa015, "HSetVol"},
+	{0xa017, "Eject"}, {0xa018, "GetFPos"}, {0xa035, "Offline"}, {0xa041, "SetFilLock"},
+	{0xa042, "RstFilLock"}, {0xa043, "SetFilType"}, {0xa044, "SetFPos"}, {0xa045, "FlushFile"},
+	{0x0001, "OpenWD"}, {0x0002, "CloseWD"}, {0x0005, "CatMove"}, {0x0006, "DirCreate"},
+	{0x0007, "GetWDInfo"}, {0x0008, "GetFCBInfo"}, {0x0009, "GetCatInfo"},
+	{0x000a, "SetCatInfo"}, {0x000b, "SetVolInfo"}, {0x0012, "XGetVolInfo"},
+	{0x0018, "CatSearch"}, {0x001a, "OpenDF"}, {0x001b, "MakeFSSpec"}, {0x0030, "GetVolParms"},
+};
+
+static struct {int32_t id; char *path;} dirs[MAXDIRS]; // "" is the root
+static struct {int16_t refNum; uint32_t fid;} opens[MAXOPEN];
+static struct profSlot replayed[PROFSLOTS], traced[PROFSLOTS];
+static char iobuf[SERVERMSIZE];
+
+static const char *selName(uint16_t selector) {
+	for (int i=0; i<sizeof names/sizeof *names; i++) {
+		if (names[i].selector == selector) return names[i].name;
+	}
+	static char hex[8];
+	sprintf(hex, "%04x", selector);
+	return hex;
+}
+
+static bool isRefNumCall(uint16_t selector) {
+	switch (selector) {
+	case 0xa001: case 0xa002: case 0xa003: case 0xa010: case 0xa011:
+	case 0xa012: case 0xa018: case 0xa044: case 0xa045:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool changesShare(uint16_t selector) {
+	switch (selector) {
+	case 0xa003: case 0xa008: case 0xa009: case 0xa00b: case 0xa00d:
+	case 0xa012: case 0x0005: case 0x0006: case 0x000a:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static uint32_t be(const uint8_t *p, int bytes) {
+	uint32_t v = 0;
+	for (int i=0; i<bytes; i++) v = (v << 8) | p[i];
+	return v;
+}
+
+// Either the raw file, or the hex dumped to the log by traceFlush
+static uint8_t *loadTrace(const char *path, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	size_t n = ftell(f);
+	rewind(f);
+	uint8_t *data = malloc(n + 1);
+	n = fread(data, 1, n, f);
+	fclose(f);
+	data[n] = 0;
+
+	if (!memmem(data, n, "Trace: ", 7)) {
+		*size = n;
+		return data;
+	}
+
+	size_t out = 0;
+	for (char *line=strtok((char *)data, "\n"); line; line=strtok(NULL, "\n")) {
+		char *hex = strstr(line, "Trace: ");
+		if (!hex) continue;
+		hex += 7;
+		if (strspn(hex, "0123456789abcdef") != RECSIZE*2) continue; // a message
+		for (int i=0; i<RECSIZE; i++) {
+			unsigned byte;
+			sscanf(hex + i*2, "%2x", &byte);
+			data[out++] = byte; // never overtakes the text being read
+		}
+	}
+	*size = out;
+	return data;
+}
+
+static struct rec decode(const uint8_t *p) {
+	struct rec r = {
+		.selector = be(p, 2), .result = be(p+2, 2),
+		.start = be(p+4, 4), .duration = be(p+8, 4),
+		.dirID = be(p+12, 4), .outDirID = be(p+16, 4),
+		.count = be(p+20, 4), .actual = be(p+24, 4), .position = be(p+28, 4),
+		.roundtrips = be(p+32, 2), .vRefNum = be(p+34, 2), .refNum = be(p+36, 2),
+	};
+	memcpy(r.name, p+38, sizeof r.name);
+	return r;
+}
+
+static char **dirSlot(int32_t id) {
+	for (uint32_t i=id;; i++) {
+		i &= MAXDIRS - 1;
+		if (dirs[i].path == NULL || dirs[i].id == id) {
+			dirs[i].id = id;
+			return &dirs[i].path;
+		}
+	}
+}
+
+static const char *dirPath(int32_t id) {
+	char **p = dirSlot(id);
+	return *p ? *p : "";
+}
+
+// A dirID and a Mac path (full, partial or empty) to a host path
+static void resolve(int32_t dirID, const unsigned char *name, char *out) {
+	char macpath[256];
+	memcpy(macpath, name+1, name[0]);
+	macpath[name[0]] = 0;
+
+	// "Volume:a:b" is a full path, ":a:b" and "a" are relative
+	char *s = macpath;
+	if (strchr(s, ':') && s[0] != ':') {
+		s = strchr(s, ':') + 1;
+		strcpy(out, "");
+	} else {
+		strcpy(out, dirPath(dirID));
+		if (s[0] == ':') s++;
+	}
+
+	while (*s) {
+		char *colon = strchr(s, ':');
+		size_t len = colon ? colon - s : strlen(s);
+
+		unsigned char roman[32] = {len > 31 ? 31 : len};
+		memcpy(roman+1, s, roman[0]);
+		char utf8[512];
+		if (len == 0) {
+			strcpy(utf8, ".."); // "::" goes up
+		} else {
+			utf8name(utf8, roman);
+		}
+
+		if (*out) strcat(out, "/");
+		strcat(out, utf8);
+		s += len + (colon != NULL);
+	}
+}
+
+// Walk from the root, returning the number of components
+static int walkPath(const char *path, uint32_t fid) {
+	char copy[4096];
+	const char *comps[256];
+	int n = 0;
+
+	strcpy(copy, path);
+	for (char *c=strtok(copy, "/"); c && n<256; c=strtok(NULL, "/")) comps[n++] = c;
+
+	return Walk9(ROOTFID, fid, n, comps, NULL, NULL) ? -1 : n;
+}
+
+static uint32_t *openFid(int16_t refNum, bool add) {
+	for (int i=0; i<MAXOPEN; i++) {
+		if (opens[i].refNum == refNum && opens[i].fid) return &opens[i].fid;
+	}
+	if (!add) return NULL;
+	for (int i=0; i<MAXOPEN; i++) {
+		if (!opens[i].fid) {
+			opens[i].refNum = refNum;
+			opens[i].fid = OPENFID + i;
+			return &opens[i].fid;
+		}
+	}
+	return NULL;
+}
+
+static void replay(const struct rec *r) {
+	char path[4096];
+
+	if (changesShare(r->selector)) return;
+
+	switch (r->selector) {
+	case 0xa000: case 0xa00a: case 0x001a: { // opens
+		if (r->result != 0) break;
+		resolve(r->dirID, r->name, path);
+		if (r->selector == 0xa00a) strcat(path, ".rsrc");
+		uint32_t *fid = openFid(r->refNum, true);
+		if (!fid) break;
+		if (walkPath(path, *fid) < 0 || Lopen9(*fid, O_RDONLY, NULL, NULL)) {
+			Clunk9(*fid);
+			*fid = 0;
+		}
+		break;
+	}
+	case 0xa001: { // close
+		uint32_t *fid = openFid(r->refNum, false);
+		if (fid) {
+			Clunk9(*fid);
+			*fid = 0;
+		}
+		break;
+	}
+	case 0xa002: { // read: position is the mark afterwards
+		uint32_t *fid = openFid(r->refNum, false);
+		if (fid && r->count) {
+			uint32_t got;
+			uint32_t count = r->count < sizeof iobuf ? r->count : sizeof iobuf;
+			ReadMany9(*fid, iobuf, r->position - r->actual, count, &got);
+		}
+		break;
+	}
+	default:
+		if (isRefNumCall(r->selector)) break; // the FCB has the answer
+
+		if (r->name[0]) {
+			// A lookup by name
+			resolve(r->dirID, r->name, path);
+			if (walkPath(path, WALKFID) >= 0) {
+				struct Stat9 st;
+				Getattr9(WALKFID, STAT_ALL, &st);
+				Clunk9(WALKFID);
+				if (r->result == 0 && r->outDirID) {
+					char **slot = dirSlot(r->outDirID);
+					if (!*slot) *slot = strdup(path);
+				}
+			}
+		} else if (r->dirID > 1) {
+			// Indexed, so the driver lists the directory (once, then caches)
+			char **slot = dirSlot(-r->dirID); // negative: listed already
+			if (*slot) break;
+			*slot = "";
+			if (walkPath(dirPath(r->dirID), DIRFID) < 0) break;
+			if (!Lopen9(DIRFID, O_RDONLY|O_DIRECTORY, NULL, NULL)) {
+				static char buf[64*1024];
+				char name[512];
+				InitReaddir9(DIRFID, buf, sizeof buf);
+				while (Readdir9(buf, NULL, NULL, name) == 0) {}
+			}
+			Clunk9(DIRFID);
+		}
+		break;
+	}
+}
+
+// Like profDump, side by side with what the trace recorded
+static void report(void) {
+	uint64_t grand = 0;
+	for (struct profSlot *s=replayed; s<replayed+PROFSLOTS && s->inuse; s++) grand += s->total;
+
+	printf("%-14s %7s %10s %4s %8s %8s %7s | %9s %7s\n",
+		"call", "calls", "total-us", "%", "mean-us", "worst-us", "rt/call", "traced-us", "rt/call");
+	for (struct profSlot *s=replayed; s<replayed+PROFSLOTS && s->inuse; s++) {
+		struct profSlot *t = traced;
+		while (t->selector != s->selector) t++;
+
+		printf("%-14s %7u %10llu %4llu %8llu %8u %7.2f | %9llu %7.2f\n",
+			selName(s->selector), s->calls, (unsigned long long)s->total,
+			(unsigned long long)(s->total * 100 / (grand + 1)),
+			(unsigned long long)(s->total / s->calls), s->worst,
+			(double)s->events / s->calls,
+			(unsigned long long)(t->total / t->calls), (double)t->events / t->calls);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s TRACE DIR\n", argv[0]);
+		return 1;
+	}
+
+	size_t size;
+	uint8_t *data = loadTrace(argv[1], &size);
+	if (!data) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	ServerInit9(argv[2]);
+	if (Init9(256) || Attach9(ROOTFID, NOFID, "", "", 0, NULL)) {
+		fprintf(stderr, "cannot attach to %s\n", argv[2]);
+		return 1;
+	}
+	*dirSlot(2) = "";
+
+	uint32_t start = profNow(), attach = Roundtrips9, calls = 0;
+	for (size_t i=0; i+RECSIZE<=size; i+=RECSIZE) {
+		struct rec r = decode(data + i);
+
+		uint32_t t = profNow(), trips = Roundtrips9;
+		replay(&r);
+		profRecord(replayed, r.selector, profNow() - t, Roundtrips9 - trips);
+		profRecord(traced, r.selector, r.duration, r.roundtrips);
+		calls++;
+	}
+
+	printf("Replayed %u calls in %.1f ms, %u round trips\n",
+		calls, (profNow() - start) / 1e3, (unsigned)(Roundtrips9 - attach));
+	report();
+	return 0;
+}
@@ -0,0 +1,495 @@
+/*
+In-process 9P2000.L server backed by a real directory, for host testing
+
+Implements the messages that 9p.c sends, much as QEMU's local backend does,
+but single-threaded and without any security model. Errors are returned as
+Rlerror with the host errno, which matches the Linux numbering in 9p.h.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "host9p.h"
+
+enum {
+	MAXFID = 4096,
+	Rlerror = 7,
+};
+
+struct fid {
+	char *path; // NULL = unused
+	int fd; // -1 = not open
+	int flags;
+	struct dirent **list; // directory listing, taken at Tlopen
+	int nlist;
+};
+
+static const char *rootpath;
+static uint32_t msize = SERVERMSIZE;
+int ServerFailWrite;
+static struct fid fids[MAXFID];
+
+// Cursor over a message
+struct msg {
+	unsigned char *p;
+	size_t at, max;
+};
+
+static uint64_t get(struct msg *m, int bytes) {
+	uint64_t v = 0;
+	for (int i=0; i<bytes; i++) v |= (uint64_t)m->p[m->at + i] << (8*i);
+	m->at += bytes;
+	return v;
+}
+
+// Returns a malloc'd C string
+static char *getstr(struct msg *m) {
+	uint16_t len = get(m, 2);
+	char *s = malloc(len + 1);
+	memcpy(s, m->p + m->at, len);
+	s[len] = 0;
+	m->at += len;
+	return s;
+}
+
+static void put(struct msg *m, uint64_t v, int bytes) {
+	for (int i=0; i<bytes; i++) m->p[m->at + i] = v >> (8*i);
+	m->at += bytes;
+}
+
+static void putstr(struct msg *m, const char *s) {
+	size_t len = strlen(s);
+	put(m, len, 2);
+	memcpy(m->p + m->at, s, len);
+	m->at += len;
+}
+
+static void putqid(struct msg *m, const struct stat *st) {
+	put(m, S_ISDIR(st->st_mode) ? 0x80 : S_ISLNK(st->st_mode) ? 0x02 : 0, 1);
+	put(m, (uint32_t)(st->st_mtime ^ (st->st_size << 8)), 4); // like QEMU: changes on modify
+	put(m, st->st_ino, 8);
+}
+
+static char *join(const char *dir, const char *name) {
+	char *s = malloc(strlen(dir) + strlen(name) + 2);
+	sprintf(s, "%s/%s", dir, name);
+	return s;
+}
+
+static struct fid *getfid(uint32_t fid) {
+	if (fid >= MAXFID || fids[fid].path == NULL) return NULL;
+	return &fids[fid];
+}
+
+static void clunk(struct fid *f) {
+	if (f->fd >= 0) close(f->fd);
+	for (int i=0; i<f->nlist; i++) free(f->list[i]);
+	free(f->list);
+	free(f->path);
+	*f = (struct fid){.fd = -1};
+}
+
+static void setfid(uint32_t fid, char *path) {
+	if (fids[fid].path) clunk(&fids[fid]);
+	fids[fid] = (struct fid){.path = path, .fd = -1};
+}
+
+static int alldirents(const struct dirent *d) {
+	return 1;
+}
+
+void ServerInit9(const char *root) {
+	rootpath = root;
+	for (int i=0; i<MAXFID; i++) fids[i] = (struct fid){.fd = -1};
+}
+
+// Each handler reads its arguments from t and writes its reply fields to r,
+// returning zero or an errno
+static int version(struct msg *t, struct msg *r) {
+	uint32_t want = get(t, 4);
+	free(getstr(t));
+	msize = want < SERVERMSIZE ? want : SERVERMSIZE;
+	put(r, msize, 4);
+	putstr(r, "9P2000.L");
+	return 0;
+}
+
+static int attach(struct msg *t, struct msg *r) {
+	uint32_t fid = get(t, 4);
+	if (fid >= MAXFID) return EINVAL;
+	struct stat st;
+	if (lstat(rootpath, &st)) return errno;
+	setfid(fid, strdup(rootpath));
+	putqid(r, &st);
+	return 0;
+}
+
+static int walk(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	uint32_t newfid = get(t, 4);
+	uint16_t nwname = get(t, 2);
+	if (!f || newfid >= MAXFID) return EBADF;
+
+	char *path = strdup(f->path);
+	size_t countat = r->at;
+	put(r, 0, 2);
+
+	int ok = 0;
+	for (; ok<nwname; ok++) {
+		char *name = getstr(t);
+		char *next = join(path, name);
+		free(name);
+
+		struct stat st;
+		if (lstat(next, &st)) {
+			int err = errno;
+			free(next);
+			if (ok == 0) {
+				free(path);
+				return err;
+			}
+			break;
+		}
+		free(path);
+		path = next;
+		putqid(r, &st);
+	}
+
+	size_t end = r->at;
+	r->at = countat;
+	put(r, ok, 2);
+	r->at = end;
+
+	// Only a complete walk creates the new fid
+	if (ok == nwname) {
+		setfid(newfid, path);
+	} else {
+		free(path);
+	}
+	return 0;
+}
+
+static int lopen(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	uint32_t flags = get(t, 4);
+	if (!f) return EBADF;
+
+	struct stat st;
+	if (lstat(f->path, &st)) return errno;
+
+	if (S_ISDIR(st.st_mode)) {
+		f->nlist = scandir(f->path, &f->list, alldirents, alphasort);
+		if (f->nlist < 0) {
+			f->nlist = 0;
+			return errno;
+		}
+		f->fd = open(f->path, O_RDONLY|O_DIRECTORY);
+	} else {
+		f->fd = open(f->path, flags & ~O_CREAT);
+	}
+	if (f->fd < 0) return errno;
+	f->flags = flags;
+
+	putqid(r, &st);
+	put(r, 0, 4); // iounit
+	return 0;
+}
+
+static int lcreate(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	char *name = getstr(t);
+	uint32_t flags = get(t, 4);
+	uint32_t mode = get(t, 4);
+	get(t, 4); // gid
+	if (!f) {
+		free(name);
+		return EBADF;
+	}
+
+	char *path = join(f->path, name);
+	free(name);
+	int fd = open(path, flags | O_CREAT, mode);
+	if (fd < 0) {
+		free(path);
+		return errno;
+	}
+
+	// The fid now stands for the new file
+	free(f->path);
+	f->path = path;
+	f->fd = fd;
+	f->flags = flags;
+
+	struct stat st;
+	fstat(fd, &st);
+	putqid(r, &st);
+	put(r, 0, 4);
+	return 0;
+}
+
+static int rread(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	uint64_t offset = get(t, 8);
+	uint32_t count = get(t, 4);
+	if (!f || f->fd < 0) return EBADF;
+
+	if (count > msize - 11) count = msize - 11;
+	ssize_t got = pread(f->fd, r->p + r->at + 4, count, offset);
+	if (got < 0) return errno;
+	put(r, got, 4);
+	r->at += got;
+	return 0;
+}
+
+static int rwrite(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	uint64_t offset = get(t, 8);
+	uint32_t count = get(t, 4);
+	if (!f || f->fd < 0) return EBADF;
+	if (ServerFailWrite && --ServerFailWrite == 0) return EIO;
+
+	ssize_t did;
+	if (f->flags & O_APPEND) {
+		did = write(f->fd, t->p + t->at, count);
+	} else {
+		did = pwrite(f->fd, t->p + t->at, count, offset);
+	}
+	if (did < 0) return errno;
+	put(r, did, 4);
+	return 0;
+}
+
+// The offset is an index into the listing taken at Tlopen
+static int readdir9(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	uint64_t offset = get(t, 8);
+	uint32_t count = get(t, 4);
+	if (!f || f->fd < 0) return EBADF;
+
+	if (count > msize - 11) count = msize - 11;
+	size_t countat = r->at;
+	put(r, 0, 4);
+	size_t start = r->at;
+
+	for (uint64_t i=offset; i<f->nlist; i++) {
+		const char *name = f->list[i]->d_name;
+		if (r->at - start + 24 + strlen(name) > count) break;
+
+		char *path = join(f->path, name);
+		struct stat st = {};
+		lstat(path, &st);
+		free(path);
+
+		putqid(r, &st);
+		put(r, i + 1, 8);
+		put(r, f->list[i]->d_type, 1);
+		putstr(r, name);
+	}
+
+	size_t end = r->at;
+	r->at = countat;
+	put(r, end - start, 4);
+	r->at = end;
+	return 0;
+}
+
+static int getattr(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	get(t, 8); // request_mask: always send the basics
+	if (!f) return EBADF;
+
+	struct stat st;
+	if (lstat(f->path, &st)) return errno;
+
+	put(r, 0x7ff, 8); // valid
+	putqid(r, &st);
+	put(r, st.st_mode, 4);
+	put(r, st.st_uid, 4);
+	put(r, st.st_gid, 4);
+	put(r, st.st_nlink, 8);
+	put(r, st.st_rdev, 8);
+	put(r, st.st_size, 8);
+	put(r, st.st_blksize, 8);
+	put(r, st.st_blocks, 8);
+	put(r, st.st_atim.tv_sec, 8);
+	put(r, st.st_atim.tv_nsec, 8);
+	put(r, st.st_mtim.tv_sec, 8);
+	put(r, st.st_mtim.tv_nsec, 8);
+	put(r, st.st_ctim.tv_sec, 8);
+	put(r, st.st_ctim.tv_nsec, 8);
+	put(r, 0, 8); // btime
+	put(r, 0, 8);
+	put(r, 0, 8); // gen
+	put(r, 0, 8); // data_version
+	return 0;
+}
+
+static int setattr(struct msg *t, struct msg *r) {
+	enum {SET_MODE = 1, SET_SIZE = 8, SET_ATIME = 0x10, SET_MTIME = 0x20, SET_ATIME_SET = 0x80, SET_MTIME_SET = 0x100};
+
+	struct fid *f = getfid(get(t, 4));
+	uint32_t valid = get(t, 4);
+	uint32_t mode = get(t, 4);
+	get(t, 4); // uid
+	get(t, 4); // gid
+	uint64_t size = get(t, 8);
+	struct timespec times[2];
+	times[0].tv_sec = get(t, 8);
+	times[0].tv_nsec = get(t, 8);
+	times[1].tv_sec = get(t, 8);
+	times[1].tv_nsec = get(t, 8);
+	if (!f) return EBADF;
+
+	if ((valid & SET_MODE) && chmod(f->path, mode)) return errno;
+	if ((valid & SET_SIZE) && truncate(f->path, size)) return errno;
+	if (valid & (SET_ATIME|SET_MTIME)) {
+		if (!(valid & SET_ATIME)) times[0].tv_nsec = UTIME_OMIT;
+		else if (!(valid & SET_ATIME_SET)) times[0].tv_nsec = UTIME_NOW;
+		if (!(valid & SET_MTIME)) times[1].tv_nsec = UTIME_OMIT;
+		else if (!(valid & SET_MTIME_SET)) times[1].tv_nsec = UTIME_NOW;
+		if (utimensat(AT_FDCWD, f->path, times, AT_SYMLINK_NOFOLLOW)) return errno;
+	}
+	return 0;
+}
+
+static int statfs9(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	if (!f) return EBADF;
+
+	struct statvfs sv;
+	if (statvfs(f->path, &sv)) return errno;
+
+	put(r, 0x01021997, 4); // V9FS_MAGIC
+	put(r, sv.f_bsize, 4);
+	put(r, sv.f_blocks, 8);
+	put(r, sv.f_bfree, 8);
+	put(r, sv.f_bavail, 8);
+	put(r, sv.f_files, 8);
+	put(r, sv.f_ffree, 8);
+	put(r, sv.f_fsid, 8);
+	put(r, sv.f_namemax, 4);
+	return 0;
+}
+
+static int mkdir9(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	char *name = getstr(t);
+	uint32_t mode = get(t, 4);
+	get(t, 4); // gid
+	int err = 0;
+
+	char *path = f ? join(f->path, name) : NULL;
+	struct stat st;
+	if (!f) err = EBADF;
+	else if (mkdir(path, mode) || lstat(path, &st)) err = errno;
+	else putqid(r, &st);
+
+	free(name);
+	free(path);
+	return err;
+}
+
+static int unlinkat9(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	char *name = getstr(t);
+	uint32_t flags = get(t, 4);
+	int err = 0;
+
+	char *path = f ? join(f->path, name) : NULL;
+	if (!f) err = EBADF;
+	else if ((flags & 0x200) ? rmdir(path) : unlink(path)) err = errno;
+
+	free(name);
+	free(path);
+	return err;
+}
+
+static int renameat9(struct msg *t, struct msg *r) {
+	struct fid *olddir = getfid(get(t, 4));
+	char *oldname = getstr(t);
+	struct fid *newdir = getfid(get(t, 4));
+	char *newname = getstr(t);
+	int err = 0;
+
+	if (!olddir || !newdir) {
+		err = EBADF;
+	} else {
+		char *from = join(olddir->path, oldname), *to = join(newdir->path, newname);
+		if (rename(from, to)) err = errno;
+		free(from);
+		free(to);
+	}
+
+	free(oldname);
+	free(newname);
+	return err;
+}
+
+static int remove9(struct msg *t, struct msg *r) {
+	uint32_t fid = get(t, 4);
+	struct fid *f = getfid(fid);
+	if (!f) return EBADF;
+	int err = remove(f->path) ? errno : 0;
+	clunk(f); // even on failure
+	return err;
+}
+
+static int clunk9(struct msg *t, struct msg *r) {
+	struct fid *f = getfid(get(t, 4));
+	if (!f) return EBADF;
+	clunk(f);
+	return 0;
+}
+
+size_t Serve9(const void *tbuf, size_t tlen, void *rbuf, size_t rmax) {
+	struct msg t = {(void *)tbuf, 0, tlen}, r = {rbuf, 0, rmax};
+
+	get(&t, 4); // size
+	uint8_t cmd = get(&t, 1);
+	uint16_t tag = get(&t, 2);
+
+	r.at = 7; // fill in the header last
+	int err;
+	switch (cmd) {
+	case 100: err = version(&t, &r); break;
+	case 104: err = attach(&t, &r); break;
+	case 110: err = walk(&t, &r); break;
+	case 12: err = lopen(&t, &r); break;
+	case 14: err = lcreate(&t, &r); break;
+	case 116: err = rread(&t, &r); break;
+	case 118: err = rwrite(&t, &r); break;
+	case 40: err = readdir9(&t, &r); break;
+	case 24: err = getattr(&t, &r); break;
+	case 26: err = setattr(&t, &r); break;
+	case 8: err = statfs9(&t, &r); break;
+	case 72: err = mkdir9(&t, &r); break;
+	case 76: err = unlinkat9(&t, &r); break;
+	case 74: err = renameat9(&t, &r); break;
+	case 122: err = remove9(&t, &r); break;
+	case 120: err = clunk9(&t, &r); break;
+	default: err = EOPNOTSUPP; break; // including xattrs
+	}
+
+	if (err) {
+		r.at = 7;
+		put(&r, err, 4);
+		cmd = Rlerror - 1;
+	}
+
+	size_t size = r.at;
+	r.at = 0;
+	put(&r, size, 4);
+	put(&r, cmd + 1, 1);
+	put(&r, tag, 2);
+	return size;
+}
@@ -0,0 +1,96 @@
+// Stand-ins for the driver's edges, so that 9p.c runs on the host:
+// Memory Mgr/Driver Services calls, a virtqueue that hands each request
+// straight to the in-process server, and the logging and panic functions
+
+#include <DriverServices.h>
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../virtqueue.h"
+#include "host9p.h"
+
+void QueueNotified9(void *tag);
+
+static char treq[SERVERMSIZE], rresp[SERVERMSIZE];
+// Completed but not yet polled, as a real virtqueue's used ring would hold
+enum {MAXPENDING = 256};
+static void *pending[MAXPENDING];
+static int npending;
+
+OSStatus LockMemory(void *address, ByteCount count) {
+	return 0;
+}
+
+OSStatus UnlockMemory(void *address, ByteCount count) {
+	return 0;
+}
+
+// One extent, the same as the logical range
+OSStatus GetPhysical(void *addressRangeTable, ItemCount *numberOfExtents) {
+	MemoryBlock *mbs = addressRangeTable;
+	mbs[1] = mbs[0];
+	*numberOfExtents = 1;
+	return 0;
+}
+
+// 9p.c fills an array of PhysicalAddress, which on the host is an array of
+// pointers, and passes it as uint32_t *: so cast it back
+bool QSend(uint16_t q, uint16_t n_out, uint16_t n_in, uint32_t *phys_addrs, uint32_t *sizes, void *tag) {
+	if (npending == MAXPENDING) abort();
+	void **addrs = (void **)phys_addrs;
+
+	size_t tlen = 0;
+	for (int i=0; i<n_out; i++) {
+		if (tlen + sizes[i] > sizeof treq) abort();
+		memcpy(treq + tlen, addrs[i], sizes[i]);
+		tlen += sizes[i];
+	}
+
+	size_t rlen = Serve9(treq, tlen, rresp, sizeof rresp);
+
+	size_t done = 0;
+	for (int i=n_out; i<n_out+n_in && done<rlen; i++) {
+		size_t n = rlen - done;
+		if (n > sizes[i]) n = sizes[i];
+		memcpy(addrs[i], rresp + done, n);
+		done += n;
+	}
+
+	pending[npending++] = tag;
+	return true;
+}
+
+void QNotify(uint16_t q) {
+}
+
+void QPoll(uint16_t q) {
+	for (int i=0; i<npending; i++) {
+		QueueNotified9(pending[i]);
+	}
+	npending = 0;
+}
+
+int printf_(const char *format, ...) {
+	va_list va;
+	va_start(va, format);
+	int n = vprintf(format, va);
+	va_end(va);
+	return n;
+}
+
+int sprintf_(char *buffer, const char *format, ...) {
+	va_list va;
+	va_start(va, format);
+	int n = vsprintf(buffer, format, va);
+	va_end(va);
+	return n;
+}
+
+void panic(const char *panicstr) {
+	fprintf(stderr, "panic: %s\n", panicstr);
+	abort();
+}
@@ -1,14 +1,71 @@
-// Header-only file for measuring ticks used by a function
+// Header-only microsecond profiler, keyed by a 16-bit selector
 
-// "Ticks" is a 32-bit counter at low-memory 0x16a of 60 Hz ticks
+// Keeps per-selector call counts, total and worst-case latency, a log2
+// latency histogram, and a count of some other event per call (e.g. 9P round
+// trips). Microseconds() is a trap on 68k and an InterfaceLib call on PowerPC,
+// so this works in both drivers, unlike UpTime().
 
-#define TIMESTART(counter) counter -= (((unsigned long)*(volatile unsigned short *)0x16a << 16) + *(volatile unsigned short *)0x16c)
-#define TIMESTOP(counter) counter += (((unsigned long)*(volatile unsigned short *)0x16a << 16) + *(volatile unsigned short *)0x16c)
+#pragma once
 
-#define TIMEFUNC(counter) \
-	TIMESTART(counter); \
-	unsigned long *FNCCTR __attribute__ ((__cleanup__(timingCleanup))) = &(counter);
+#include <Timer.h>
 
-static void timingCleanup(unsigned long **counter) {
-	TIMESTOP(**counter);
+#include <stdint.h>
+
+#include "printf.h"
+
+enum {
+	PROFSLOTS = 64, // distinct selectors, more are not recorded
+	PROFBUCKETS = 20, // bucket n is 2^(n-1) to 2^n-1 us, the last catches the rest
+};
+
+struct profSlot {
+	uint16_t selector;
+	uint16_t inuse;
+	uint32_t calls;
+	uint32_t events;
+	uint32_t worst; // us
+	uint64_t total; // us
+	uint32_t histogram[PROFBUCKETS];
+};
+
+// Wraps every 71 minutes, fine for measuring intervals
+static inline uint32_t profNow(void) {
+	UnsignedWide t;
+	Microseconds(&t);
+	return t.lo;
+}
+
+static inline void profRecord(struct profSlot *prof, uint16_t selector, uint32_t us, uint32_t events) {
+	struct profSlot *s = prof;
+	while (s < prof + PROFSLOTS && s->inuse && s->selector != selector) s++;
+	if (s == prof + PROFSLOTS) return;
+
+	s->selector = selector;
+	s->inuse = 1;
+	s->calls++;
+	s->events += events;
+	s->total += us;
+	if (us > s->worst) s->worst = us;
+
+	int bucket = 0;
+	while (bucket < PROFBUCKETS-1 && (us >> bucket) != 0) bucket++;
+	s->histogram[bucket]++;
+}
+
+static inline void profDump(struct profSlot *prof, const char *eventname) {
+	uint64_t grand = 0;
+	for (struct profSlot *s=prof; s<prof+PROFSLOTS && s->inuse; s++) grand += s->total;
+
+	printf("Profile: sel     calls   total-us  %%   mean-us worst-us %s/call\n", eventname);
+	for (struct profSlot *s=prof; s<prof+PROFSLOTS && s->inuse; s++) {
+		printf("Profile: %04x %8lu %10lu %3lu %8lu %8lu %lu.%02lu\n",
+			s->selector, s->calls, (uint32_t)s->total,
+			(uint32_t)(s->total * 100 / (grand + 1)),
+			(uint32_t)(s->total / s->calls), s->worst,
+			s->events / s->calls, s->events * 100 / s->calls % 100);
+
+		printf("Profile:      log2 us:");
+		for (int i=0; i<PROFBUCKETS; i++) printf(" %lu", s->histogram[i]);
+		printf("\n");
+	}
 }